@@ -12,6 +12,8 @@ namespace {
 const int page_size	= 4096;
 int64_t nr_total_pages	= 256 * 1024;
 int64_t nr_slot_pages	= 256 * 1024;
+mem_backing::type backing = mem_backing::anon;
+int numa_node		= -1;
 
 // Return the current time in nanoseconds.
 uint64_t time_ns()
@@ -46,6 +48,35 @@ void do_guest_write(kvm::vcpu& vcpu, void* slot_head,
     vcpu.run();
 }
 
+// Check how long it takes to find the dirty pages in the log: with the
+// iterator, with a popcount of the log, and probing every page.
+void scan_dirty_log(mem_slot& slot, void* slot_head)
+{
+    uint64_t gpa = reinterpret_cast<uintptr_t>(slot_head);
+    int64_t nr_iter = 0, nr_probe = 0;
+
+    uint64_t start_ns = time_ns();
+    for (mem_slot::dirty_iterator it = slot.dirty_begin();
+         it != slot.dirty_end(); ++it) {
+        ++nr_iter;
+    }
+    uint64_t iter_ns = time_ns();
+    int64_t nr_count = slot.nr_dirty();
+    uint64_t count_ns = time_ns();
+    for (int64_t i = 0; i < nr_slot_pages; ++i) {
+        nr_probe += slot.is_dirty(gpa + i * page_size);
+    }
+    uint64_t probe_ns = time_ns();
+
+    printf("scan dirty log: iterate %10lld ns, count %10lld ns, "
+           "probe %10lld ns\n", iter_ns - start_ns, count_ns - iter_ns,
+           probe_ns - count_ns);
+    if (nr_iter != nr_count || nr_iter != nr_probe) {
+        printf("dirty-log-perf: %lld iterated, %lld counted, %lld probed\n",
+               nr_iter, nr_count, nr_probe);
+    }
+}
+
 // Check how long it takes to update dirty log.
 void check_dirty_log(kvm::vcpu& vcpu, mem_slot& slot, void* slot_head)
 {
@@ -61,6 +92,7 @@ void check_dirty_log(kvm::vcpu& vcpu, mem_slot& slot, void* slot_head)
 
         printf("get dirty log: %10lld ns for %10lld dirty pages\n",
                end_ns - start_ns, i);
+        scan_dirty_log(slot, slot_head);
     }
 
     slot.set_dirty_logging(false);
@@ -73,7 +105,7 @@ void parse_options(int ac, char **av)
     int opt;
     char *endptr;
 
-    while ((opt = getopt(ac, av, "n:m:")) != -1) {
+    while ((opt = getopt(ac, av, "n:m:b:N:")) != -1) {
         switch (opt) {
         case 'n':
             errno = 0;
@@ -97,6 +129,20 @@ void parse_options(int ac, char **av)
                 nr_total_pages *= 1024;
             }
             break;
+        case 'b':
+            if (!mem_backing::parse(optarg, backing)) {
+                printf("dirty-log-perf: Invalid backing: -b %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            errno = 0;
+            numa_node = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || numa_node < 0) {
+                printf("dirty-log-perf: Invalid node: -N %s\n", optarg);
+                exit(1);
+            }
+            break;
         default:
             printf("dirty-log-perf: Invalid option\n");
             exit(1);
@@ -108,8 +154,12 @@ void parse_options(int ac, char **av)
                nr_slot_pages, nr_total_pages);
         exit(1);
     }
-    printf("dirty-log-perf: %lld slot pages / %lld mem pages\n",
-           nr_slot_pages, nr_total_pages);
+    printf("dirty-log-perf: %lld slot pages / %lld mem pages, %s",
+           nr_slot_pages, nr_total_pages, mem_backing::name(backing));
+    if (numa_node >= 0) {
+        printf(" on node %d", numa_node);
+    }
+    printf("\n");
 }
 
 int test_main(int ac, char **av)
@@ -120,15 +170,12 @@ int test_main(int ac, char **av)
 
     parse_options(ac, av);
 
-    void* mem_head;
     int64_t mem_size = nr_total_pages * page_size;
-    if (posix_memalign(&mem_head, page_size, mem_size)) {
-        printf("dirty-log-perf: Could not allocate guest memory.\n");
-        exit(1);
-    }
+    mem_backing mem(mem_size, backing, numa_node);
+    void* mem_head = mem.addr();
     uint64_t mem_addr = reinterpret_cast<uintptr_t>(mem_head);
 
-    identity::hole hole(mem_head, mem_size);
+    identity::hole hole(mem_head, mem.size());
     identity::vm ident_vm(vm, memmap, hole);
     kvm::vcpu vcpu(vm, 0);
 
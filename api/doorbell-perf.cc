@@ -0,0 +1,267 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <boost/thread/thread.hpp>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+// Doorbell notification cost: the guest writes a 32-bit doorbell in an
+// unmapped page and the host learns about it through
+//  - exit:      a KVM_EXIT_MMIO to userspace for every write,
+//  - coalesced: the coalesced MMIO ring, drained when it fills up and
+//               when the guest is done,
+//  - eventfd:   an ioeventfd, read by a separate host thread.
+// Each mode prints writes/sec and the host CPU time (user + system, all
+// threads) per write.
+
+namespace {
+
+const int page_size	= 4096;
+unsigned nr_writes	= 1000000;
+
+volatile uint32_t* doorbell;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+// Return the CPU time used by the process so far, in nanoseconds.
+uint64_t cpu_ns()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * (uint64_t)1000000000
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * (uint64_t)1000;
+}
+
+void ring_doorbell(unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        *doorbell = i;
+    }
+}
+
+// Counts coalesced writes.
+class ring_counter : public kvm::coalesced_mmio_handler {
+public:
+    ring_counter() : count(0) {}
+    virtual void handle(const kvm_coalesced_mmio& mmio) { ++count; }
+    unsigned long count;
+};
+
+// Counts doorbell exits.  With a ring, a write only exits when the ring
+// is full, so drain it first to keep the writes in order.
+class exit_counter : public kvm::exit_handler {
+public:
+    explicit exit_counter(ring_counter* ring) : count(0), _ring(ring) {}
+    virtual bool handle(kvm::vcpu& vcpu, kvm_run& run);
+    unsigned long count;
+private:
+    ring_counter* _ring;
+};
+
+bool exit_counter::handle(kvm::vcpu& vcpu, kvm_run& run)
+{
+    if (_ring) {
+        vcpu.drain_coalesced_mmio(*_ring);
+    }
+    ++count;
+    return true;
+}
+
+// Reads the ioeventfd until every write has been seen.
+void eventfd_reader(int efd, unsigned long& wakeups)
+{
+    unsigned long total = 0;
+    eventfd_t val;
+
+    while (total < nr_writes) {
+        if (eventfd_read(efd, &val) < 0) {
+            perror("doorbell-perf: eventfd_read");
+            exit(1);
+        }
+        total += val;
+        ++wakeups;
+    }
+}
+
+void report(const char* mode, uint64_t wall_ns, uint64_t cpu,
+            const char* what, unsigned long count)
+{
+    printf("%-10s %10.0f writes/sec %6llu ns cpu/write, %lu %s\n", mode,
+           nr_writes * 1e9 / wall_ns,
+           (unsigned long long)(cpu / nr_writes), count, what);
+}
+
+using std::tr1::bind;
+
+// Run the doorbell guest to completion; the identity thunk ends it with
+// an unhandled "out" to port 0.
+void run_guest(kvm::vcpu& vcpu)
+{
+    identity::vcpu guest(vcpu, bind(ring_doorbell, nr_writes));
+    uint32_t reason = vcpu.run_loop();
+    if (reason != KVM_EXIT_IO || vcpu.shared()->io.port != 0) {
+        printf("doorbell-perf: unexpected exit %u\n", reason);
+        exit(1);
+    }
+}
+
+void test_exit(kvm::vm& vm, kvm::vcpu& vcpu, uint64_t gpa)
+{
+    exit_counter exits(NULL);
+
+    vcpu.clear_exit_handlers();
+    vcpu.add_mmio_handler(gpa, sizeof(*doorbell), exits);
+
+    uint64_t start_ns = time_ns(), start_cpu = cpu_ns();
+    run_guest(vcpu);
+    report("exit", time_ns() - start_ns, cpu_ns() - start_cpu,
+           "exits", exits.count);
+}
+
+void test_coalesced(kvm::vm& vm, kvm::vcpu& vcpu, uint64_t gpa)
+{
+    ring_counter ring;
+    exit_counter exits(&ring);
+
+    if (!vcpu.coalesced_mmio_ring()) {
+        printf("coalesced (skipped, no KVM_CAP_COALESCED_MMIO)\n");
+        return;
+    }
+    vcpu.clear_exit_handlers();
+    vcpu.add_mmio_handler(gpa, sizeof(*doorbell), exits);
+    vm.register_coalesced_mmio(gpa, sizeof(*doorbell));
+
+    uint64_t start_ns = time_ns(), start_cpu = cpu_ns();
+    run_guest(vcpu);
+    vcpu.drain_coalesced_mmio(ring);
+    report("coalesced", time_ns() - start_ns, cpu_ns() - start_cpu,
+           "exits when full", exits.count);
+
+    vm.unregister_coalesced_mmio(gpa, sizeof(*doorbell));
+    if (ring.count + exits.count != nr_writes) {
+        printf("coalesced: %lu writes drained, %lu exits\n",
+               ring.count, exits.count);
+        exit(1);
+    }
+}
+
+void test_eventfd(kvm::vm& vm, kvm::vcpu& vcpu, uint64_t gpa)
+{
+    unsigned long wakeups = 0;
+
+    if (!vm.sys().check_extension(KVM_CAP_IOEVENTFD)) {
+        printf("eventfd (skipped, no KVM_CAP_IOEVENTFD)\n");
+        return;
+    }
+    int efd = eventfd(0, 0);
+    if (efd < 0) {
+        throw errno_exception(errno);
+    }
+    vcpu.clear_exit_handlers();
+    vm.assign_ioeventfd(efd, gpa, sizeof(*doorbell));
+
+    uint64_t start_ns = time_ns(), start_cpu = cpu_ns();
+    boost::thread reader(eventfd_reader, efd, boost::ref(wakeups));
+    run_guest(vcpu);
+    reader.join();
+    report("eventfd", time_ns() - start_ns, cpu_ns() - start_cpu,
+           "reader wakeups", wakeups);
+
+    vm.deassign_ioeventfd(efd, gpa, sizeof(*doorbell));
+    close(efd);
+}
+
+struct test {
+    const char* name;
+    void (*func)(kvm::vm& vm, kvm::vcpu& vcpu, uint64_t gpa);
+};
+
+test tests[] = {
+    { "exit", test_exit },
+    { "coalesced", test_coalesced },
+    { "eventfd", test_eventfd },
+};
+
+bool test_wanted(const char* name, char** wanted, int nwanted)
+{
+    if (!nwanted) {
+        return true;
+    }
+    for (int i = 0; i < nwanted; ++i) {
+        if (strcmp(wanted[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            errno = 0;
+            nr_writes = strtoul(optarg, &endptr, 10);
+            if (errno || endptr == optarg || !nr_writes) {
+                printf("doorbell-perf: Invalid number: -n %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("doorbell-perf: usage: doorbell-perf [-n writes] [mode...]\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    parse_options(ac, av);
+
+    // Left out of the identity map, so the doorbell is not backed by RAM.
+    void* hole_head;
+    if (posix_memalign(&hole_head, page_size, page_size)) {
+        printf("doorbell-perf: Could not allocate the doorbell hole.\n");
+        exit(1);
+    }
+    doorbell = static_cast<uint32_t*>(hole_head);
+    uint64_t gpa = reinterpret_cast<uintptr_t>(hole_head);
+
+    identity::hole hole(hole_head, page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        if (test_wanted(tests[i].name, av + optind, ac - optind)) {
+            tests[i].func(vm, vcpu, gpa);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,234 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Round-trip cost of exits that KVM hands to userspace: the guest issues
+// one access per iteration, vcpu::run_loop() dispatches it to a handler
+// here and re-enters.  Nothing in this vm is emulated in the kernel (no
+// irqchip, no PIT), so every PIO, MMIO and HLT exit comes out.
+
+namespace {
+
+const int page_size	= 4096;
+const uint16_t pio_port	= 0xe0;
+unsigned nr_iterations	= 100000;
+
+volatile uint32_t* mmio_page;
+// Written by the guest; globals, unlike the host stack, are below the
+// identity map's top.
+uint64_t guest_cycles;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | ((uint64_t)hi << 32);
+}
+
+void pio_out()
+{
+    asm volatile("outb %%al, %%dx" : : "a"(0), "d"(pio_port));
+}
+
+void pio_in()
+{
+    uint8_t val;
+
+    asm volatile("inb %%dx, %%al" : "=a"(val) : "d"(pio_port));
+}
+
+void mmio_write()
+{
+    *mmio_page = 0;
+}
+
+void mmio_read()
+{
+    (void)*mmio_page;
+}
+
+void hlt()
+{
+    asm volatile("hlt");
+}
+
+struct test {
+    const char* name;
+    void (*func)();
+    uint32_t exit_reason;
+};
+
+test tests[] = {
+    { "pio-out", pio_out, KVM_EXIT_IO },
+    { "pio-in", pio_in, KVM_EXIT_IO },
+    { "mmio-write", mmio_write, KVM_EXIT_MMIO },
+    { "mmio-read", mmio_read, KVM_EXIT_MMIO },
+    { "hlt", hlt, KVM_EXIT_HLT },
+};
+
+// Counts the exits and completes reads with a fixed value.
+class count_handler : public kvm::exit_handler {
+public:
+    count_handler() : count(0) {}
+    virtual bool handle(kvm::vcpu& vcpu, kvm_run& run);
+    unsigned long count;
+};
+
+bool count_handler::handle(kvm::vcpu& vcpu, kvm_run& run)
+{
+    ++count;
+    if (run.exit_reason == KVM_EXIT_IO
+        && run.io.direction == KVM_EXIT_IO_IN) {
+        char* data = reinterpret_cast<char*>(&run) + run.io.data_offset;
+        memset(data, 0xff, run.io.size * run.io.count);
+    } else if (run.exit_reason == KVM_EXIT_MMIO && !run.mmio.is_write) {
+        memset(run.mmio.data, 0xff, run.mmio.len);
+    }
+    return true;
+}
+
+void guest_loop(void (*func)(), unsigned n)
+{
+    uint64_t t0 = rdtsc();
+    for (unsigned i = 0; i < n; ++i) {
+        func();
+    }
+    guest_cycles = rdtsc() - t0;
+}
+
+// identity::vcpu runs the guest at CPL 3, where hlt faults; the selectors
+// are the host's, so only their RPL and the descriptors' DPL change.
+void set_cpl0(kvm::vcpu& vcpu)
+{
+    kvm_sregs sregs = vcpu.sregs();
+    sregs.cs.selector &= ~3;
+    sregs.cs.dpl = 0;
+    sregs.ss.selector &= ~3;
+    sregs.ss.dpl = 0;
+    vcpu.set_sregs(sregs);
+}
+
+using std::tr1::bind;
+
+void do_test(kvm::vcpu& vcpu, test& t)
+{
+    count_handler handler;
+
+    vcpu.clear_exit_handlers();
+    switch (t.exit_reason) {
+    case KVM_EXIT_IO:
+        vcpu.add_pio_handler(pio_port, 1, handler);
+        break;
+    case KVM_EXIT_MMIO:
+        vcpu.add_mmio_handler(reinterpret_cast<uintptr_t>(mmio_page),
+                              page_size, handler);
+        break;
+    default:
+        vcpu.add_exit_handler(t.exit_reason, handler);
+        break;
+    }
+
+    identity::vcpu guest(vcpu, bind(guest_loop, t.func, nr_iterations));
+    set_cpl0(vcpu);
+
+    uint64_t start_ns = time_ns();
+    uint32_t reason = vcpu.run_loop();
+    uint64_t end_ns = time_ns();
+
+    // The identity thunk ends the guest with an unhandled "out" to port 0.
+    kvm_run* run = vcpu.shared();
+    if (reason != KVM_EXIT_IO || run->io.port != 0 || !handler.count) {
+        printf("%s: unexpected exit %u after %lu exits\n",
+               t.name, reason, handler.count);
+        exit(1);
+    }
+    printf("%-10s %8llu cycles %8llu ns per exit (%lu exits)\n", t.name,
+           (unsigned long long)(guest_cycles / handler.count),
+           (unsigned long long)((end_ns - start_ns) / handler.count),
+           handler.count);
+}
+
+bool test_wanted(const char* name, char** wanted, int nwanted)
+{
+    if (!nwanted) {
+        return true;
+    }
+    for (int i = 0; i < nwanted; ++i) {
+        if (strcmp(wanted[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            errno = 0;
+            nr_iterations = strtoul(optarg, &endptr, 10);
+            if (errno || endptr == optarg || !nr_iterations) {
+                printf("exit-perf: Invalid number: -n %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("exit-perf: usage: exit-perf [-n iterations] [test...]\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    parse_options(ac, av);
+
+    // Left out of the identity map, so guest accesses to it are MMIO.
+    void* hole_head;
+    if (posix_memalign(&hole_head, page_size, page_size)) {
+        printf("exit-perf: Could not allocate the MMIO hole.\n");
+        exit(1);
+    }
+    mmio_page = static_cast<uint32_t*>(hole_head);
+
+    identity::hole hole(hole_head, page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        if (test_wanted(tests[i].name, av + optind, ac - optind)) {
+            do_test(vcpu, tests[i]);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
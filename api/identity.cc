@@ -109,7 +109,6 @@ void vcpu::setup_regs()
     *--sp = 0;
     regs.rsp = reinterpret_cast<ulong>(sp);
     regs.rip = reinterpret_cast<ulong>(&vcpu::thunk);
-    printf("rip %llx\n", regs.rip);
     _vcpu.set_regs(regs);
 }
 
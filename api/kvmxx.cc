@@ -39,11 +39,29 @@ long fd::ioctl(unsigned nr, long arg)
     return check_error(::ioctl(_fd, nr, arg));
 }
 
-vcpu::vcpu(vm& vm, int id)
+vcpu::vcpu(vm& vm, int id, bool map)
     : _vm(vm), _fd(vm._fd.ioctl(KVM_CREATE_VCPU, id)), _shared(NULL)
     , _mmap_size(_vm._system._fd.ioctl(KVM_GET_VCPU_MMAP_SIZE, 0))
+    , _coalesced_ring(NULL), _coalesced_max(0)
+{
+    clear_exit_handlers();
+    if (map) {
+	map_shared();
+    }
+}
+
+vcpu::~vcpu()
+{
+    if (_shared) {
+	munmap(_shared, _mmap_size);
+    }
+}
 
+void vcpu::map_shared()
 {
+    if (_shared) {
+	return;
+    }
     kvm_run *shared = static_cast<kvm_run*>(::mmap(NULL, _mmap_size,
 						   PROT_READ | PROT_WRITE,
 						   MAP_SHARED,
@@ -52,11 +70,15 @@ vcpu::vcpu(vm& vm, int id)
 	throw errno_exception(errno);
     }
     _shared = shared;
-}
 
-vcpu::~vcpu()
-{
-    munmap(_shared, _mmap_size);
+    unsigned page_size = ::getpagesize();
+    unsigned offset = _vm._system.get_extension_int(KVM_CAP_COALESCED_MMIO);
+    if (offset && (offset + 1) * page_size <= _mmap_size) {
+	char* ring = reinterpret_cast<char*>(_shared) + offset * page_size;
+	_coalesced_ring = reinterpret_cast<kvm_coalesced_mmio_ring*>(ring);
+	_coalesced_max = (page_size - sizeof(kvm_coalesced_mmio_ring))
+	    / sizeof(kvm_coalesced_mmio);
+    }
 }
 
 void vcpu::run()
@@ -64,6 +86,102 @@ void vcpu::run()
     _fd.ioctl(KVM_RUN, 0);
 }
 
+exit_handler* vcpu::find(const io_range* ranges, unsigned nr,
+                         uint64_t addr, uint64_t len)
+{
+    for (unsigned i = 0; i < nr; ++i) {
+	if (addr >= ranges[i].start && addr + len <= ranges[i].end) {
+	    return ranges[i].handler;
+	}
+    }
+    return NULL;
+}
+
+uint32_t vcpu::run_loop()
+{
+    for (;;) {
+	_fd.ioctl(KVM_RUN, 0);
+
+	uint32_t reason = _shared->exit_reason;
+	exit_handler* handler = NULL;
+	switch (reason) {
+	case KVM_EXIT_IO:
+	    handler = find(_pio, _nr_pio, _shared->io.port,
+			   _shared->io.size);
+	    break;
+	case KVM_EXIT_MMIO:
+	    handler = find(_mmio, _nr_mmio, _shared->mmio.phys_addr,
+			   _shared->mmio.len);
+	    break;
+	}
+	if (!handler && reason < max_exit_reason) {
+	    handler = _exit_handlers[reason];
+	}
+	if (!handler || !handler->handle(*this, *_shared)) {
+	    return reason;
+	}
+    }
+}
+
+void vcpu::add_exit_handler(uint32_t exit_reason, exit_handler& handler)
+{
+    if (exit_reason >= max_exit_reason) {
+	throw errno_exception(EINVAL);
+    }
+    _exit_handlers[exit_reason] = &handler;
+}
+
+void vcpu::add_range(io_range* ranges, unsigned& nr, uint64_t start,
+                     uint64_t size, exit_handler& handler)
+{
+    if (nr == max_ranges) {
+	throw errno_exception(ENOSPC);
+    }
+    ranges[nr].start = start;
+    ranges[nr].end = start + size;
+    ranges[nr].handler = &handler;
+    ++nr;
+}
+
+void vcpu::add_pio_handler(uint16_t port, uint16_t count,
+                           exit_handler& handler)
+{
+    add_range(_pio, _nr_pio, port, count, handler);
+}
+
+void vcpu::add_mmio_handler(uint64_t gpa, uint64_t size,
+                            exit_handler& handler)
+{
+    add_range(_mmio, _nr_mmio, gpa, size, handler);
+}
+
+unsigned vcpu::drain_coalesced_mmio(coalesced_mmio_handler& handler)
+{
+    kvm_coalesced_mmio_ring* ring = _coalesced_ring;
+    unsigned n = 0;
+
+    if (!ring) {
+	return 0;
+    }
+    while (ring->first != ring->last) {
+	// KVM fills the entry before publishing it through "last", and
+	// reuses it once "first" has moved past it.
+	__sync_synchronize();
+	handler.handle(ring->coalesced_mmio[ring->first]);
+	__sync_synchronize();
+	ring->first = (ring->first + 1) % _coalesced_max;
+	++n;
+    }
+    return n;
+}
+
+void vcpu::clear_exit_handlers()
+{
+    std::fill(_exit_handlers, _exit_handlers + max_exit_reason,
+              static_cast<exit_handler*>(NULL));
+    _nr_pio = _nr_mmio = 0;
+}
+
 kvm_regs vcpu::regs()
 {
     kvm_regs regs;
@@ -176,6 +294,41 @@ void vm::set_tss_addr(uint32_t addr)
     _fd.ioctl(KVM_SET_TSS_ADDR, addr);
 }
 
+void vm::register_coalesced_mmio(uint64_t gpa, uint32_t size)
+{
+    struct kvm_coalesced_mmio_zone zone = { };
+    zone.addr = gpa;
+    zone.size = size;
+    _fd.ioctlp(KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+void vm::unregister_coalesced_mmio(uint64_t gpa, uint32_t size)
+{
+    struct kvm_coalesced_mmio_zone zone = { };
+    zone.addr = gpa;
+    zone.size = size;
+    _fd.ioctlp(KVM_UNREGISTER_COALESCED_MMIO, &zone);
+}
+
+void vm::assign_ioeventfd(int fd, uint64_t addr, uint32_t len,
+                          uint32_t flags, uint64_t datamatch)
+{
+    struct kvm_ioeventfd ioe = { };
+    ioe.datamatch = datamatch;
+    ioe.addr = addr;
+    ioe.len = len;
+    ioe.fd = fd;
+    ioe.flags = flags;
+    _fd.ioctlp(KVM_IOEVENTFD, &ioe);
+}
+
+void vm::deassign_ioeventfd(int fd, uint64_t addr, uint32_t len,
+                            uint32_t flags, uint64_t datamatch)
+{
+    assign_ioeventfd(fd, addr, len, flags | KVM_IOEVENTFD_FLAG_DEASSIGN,
+                     datamatch);
+}
+
 system::system(std::string device_node)
     : _fd(device_node, O_RDWR)
 {
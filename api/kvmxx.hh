@@ -15,6 +15,8 @@ class system;
 class vm;
 class vcpu;
 class fd;
+class exit_handler;
+class coalesced_mmio_handler;
 
 class fd {
 public:
@@ -31,11 +33,45 @@ private:
     int _fd;
 };
 
+// Handles one kind of exit out of vcpu::run_loop().  The kvm_run page
+// is the vcpu's shared one, so PIO "in" and MMIO read data is returned by
+// writing it there.  Return false to leave the loop.
+class exit_handler {
+public:
+    virtual ~exit_handler() {}
+    virtual bool handle(vcpu& vcpu, kvm_run& run) = 0;
+};
+
+// Receives the writes drained from the coalesced MMIO ring, in order.
+class coalesced_mmio_handler {
+public:
+    virtual ~coalesced_mmio_handler() {}
+    virtual void handle(const kvm_coalesced_mmio& mmio) = 0;
+};
+
 class vcpu {
 public:
-    vcpu(vm& vm, int fd);
+    // Without map, the kvm_run area is only mapped by map_shared(), which
+    // has to happen before the vcpu runs or its handlers are used.
+    vcpu(vm& vm, int fd, bool map = true);
     ~vcpu();
+    void map_shared();
     void run();
+    // Re-enter the guest until a handler asks to stop, or until an exit
+    // without a handler; returns the exit reason that ended the loop.
+    // PIO and MMIO exits go to the range handler covering the access,
+    // then to the handler for the exit reason.  Handlers are not owned,
+    // and dispatch does not allocate.
+    uint32_t run_loop();
+    void add_exit_handler(uint32_t exit_reason, exit_handler& handler);
+    void add_pio_handler(uint16_t port, uint16_t count, exit_handler& handler);
+    void add_mmio_handler(uint64_t gpa, uint64_t size, exit_handler& handler);
+    void clear_exit_handlers();
+    // The vm-wide coalesced MMIO ring lives in every vcpu's mapping; NULL
+    // if KVM does not support it.  Draining returns the number of writes
+    // passed to the handler.
+    kvm_coalesced_mmio_ring* coalesced_mmio_ring() { return _coalesced_ring; }
+    unsigned drain_coalesced_mmio(coalesced_mmio_handler& handler);
     kvm_run *shared();
     kvm_regs regs();
     void set_regs(const kvm_regs& regs);
@@ -46,11 +82,29 @@ public:
     void set_debug(uint64_t dr[8], bool enabled, bool singlestep);
 private:
     class kvm_msrs_ptr;
+    struct io_range {
+        uint64_t start;
+        uint64_t end;
+        exit_handler* handler;
+    };
+    static const unsigned max_exit_reason = 64;
+    static const unsigned max_ranges = 16;
+    exit_handler* find(const io_range* ranges, unsigned nr,
+                       uint64_t addr, uint64_t len);
+    void add_range(io_range* ranges, unsigned& nr, uint64_t start,
+                   uint64_t size, exit_handler& handler);
 private:
     vm& _vm;
     fd _fd;
     kvm_run *_shared;
     unsigned _mmap_size;
+    kvm_coalesced_mmio_ring* _coalesced_ring;
+    unsigned _coalesced_max;
+    exit_handler* _exit_handlers[max_exit_reason];
+    io_range _pio[max_ranges];
+    io_range _mmio[max_ranges];
+    unsigned _nr_pio;
+    unsigned _nr_mmio;
     friend class vm;
 };
 
@@ -61,6 +115,14 @@ public:
                            uint32_t flags = 0);
     void get_dirty_log(int slot, void *log);
     void set_tss_addr(uint32_t addr);
+    void register_coalesced_mmio(uint64_t gpa, uint32_t size);
+    void unregister_coalesced_mmio(uint64_t gpa, uint32_t size);
+    // flags are KVM_IOEVENTFD_FLAG_*; deassigning takes the same arguments
+    // as the assignment.
+    void assign_ioeventfd(int fd, uint64_t addr, uint32_t len,
+                          uint32_t flags = 0, uint64_t datamatch = 0);
+    void deassign_ioeventfd(int fd, uint64_t addr, uint32_t len,
+                            uint32_t flags = 0, uint64_t datamatch = 0);
     system& sys() { return _system; }
 private:
     system& _system;
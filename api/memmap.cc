@@ -1,5 +1,13 @@
 
 #include "memmap.hh"
+#include "exception.hh"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     : _map(map)
@@ -16,6 +24,19 @@ mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     }
 }
 
+mem_slot::mem_slot(mem_map& map, uint64_t gpa, const mem_backing& backing)
+    : _map(map)
+    , _slot(map._free_slots.top())
+    , _gpa(gpa)
+    , _size(backing.size())
+    , _hva(backing.addr())
+    , _dirty_log_enabled(false)
+    , _log()
+{
+    map._free_slots.pop();
+    update();
+}
+
 mem_slot::~mem_slot()
 {
     if (!_size) {
@@ -30,6 +51,14 @@ mem_slot::~mem_slot()
     }
 }
 
+void mem_slot::move(uint64_t gpa)
+{
+    _gpa = gpa;
+    if (_size) {
+        update();
+    }
+}
+
 void mem_slot::set_dirty_logging(bool enabled)
 {
     if (_dirty_log_enabled != enabled) {
@@ -73,6 +102,113 @@ bool mem_slot::is_dirty(uint64_t gpa) const
     return _log[wordnr] & bit;
 }
 
+// Return the first word at or after wordnr with a dirty bit, or the end
+// of the log.  Sparse logs are mostly zero, so with AVX2 this tests 256
+// bits at a time.
+mem_slot::ulong mem_slot::skip_clean(ulong wordnr) const
+{
+    const ulong* log = &_log[0];
+    ulong nr_words = _log.size();
+#ifdef __AVX2__
+    const ulong words_per_vec = sizeof(__m256i) / sizeof(ulong);
+    for (; wordnr + words_per_vec <= nr_words; wordnr += words_per_vec) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(log + wordnr));
+        if (!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+#endif
+    while (wordnr < nr_words && !log[wordnr]) {
+        ++wordnr;
+    }
+    return wordnr;
+}
+
+uint64_t mem_slot::next_dirty(uint64_t gpa) const
+{
+    uint64_t end = _gpa + _size;
+    if (gpa < _gpa) {
+        gpa = _gpa;
+    }
+    if (gpa >= end || _log.empty()) {
+        return end;
+    }
+    uint64_t pagenr = (gpa - _gpa) >> 12;
+    ulong wordnr = pagenr / bits_per_word;
+    ulong word = _log[wordnr] & (~0UL << (pagenr % bits_per_word));
+    if (!word) {
+        wordnr = skip_clean(wordnr + 1);
+        if (wordnr == _log.size()) {
+            return end;
+        }
+        word = _log[wordnr];
+    }
+    pagenr = uint64_t(wordnr) * bits_per_word + __builtin_ctzl(word);
+    gpa = _gpa + (pagenr << 12);
+    return gpa < end ? gpa : end;
+}
+
+uint64_t mem_slot::nr_dirty() const
+{
+    uint64_t n = 0;
+    for (ulong i = 0; i < _log.size(); ++i) {
+        n += __builtin_popcountl(_log[i]);
+    }
+    return n;
+}
+
+uint64_t mem_slot::nr_dirty(uint64_t gpa, uint64_t size) const
+{
+    uint64_t start = gpa < _gpa ? _gpa : gpa;
+    uint64_t end = gpa + size < _gpa + _size ? gpa + size : _gpa + _size;
+    if (start >= end || _log.empty()) {
+        return 0;
+    }
+    uint64_t first = (start - _gpa) >> 12;
+    uint64_t last = (end - _gpa + 4095) >> 12;
+    ulong wordnr = first / bits_per_word;
+    ulong last_word = (last - 1) / bits_per_word;
+    ulong head = ~0UL << (first % bits_per_word);
+    ulong tail = ~0UL >> (bits_per_word - 1 - (last - 1) % bits_per_word);
+    if (wordnr == last_word) {
+        return __builtin_popcountl(_log[wordnr] & head & tail);
+    }
+    uint64_t n = __builtin_popcountl(_log[wordnr] & head);
+    while (++wordnr < last_word) {
+        n += __builtin_popcountl(_log[wordnr]);
+    }
+    return n + __builtin_popcountl(_log[last_word] & tail);
+}
+
+bool mem_slot::any_dirty(uint64_t gpa, uint64_t size) const
+{
+    uint64_t next = next_dirty(gpa);
+    return next < gpa + size && next < _gpa + _size;
+}
+
+mem_slot::dirty_iterator mem_slot::dirty_begin(uint64_t gpa) const
+{
+    return dirty_iterator(*this, gpa);
+}
+
+mem_slot::dirty_iterator mem_slot::dirty_end() const
+{
+    return dirty_iterator(*this, _gpa + _size);
+}
+
+mem_slot::dirty_iterator::dirty_iterator(const mem_slot& slot, uint64_t gpa)
+    : _slot(&slot)
+    , _gpa(slot.next_dirty(gpa))
+{
+}
+
+mem_slot::dirty_iterator& mem_slot::dirty_iterator::operator++()
+{
+    _gpa = _slot->next_dirty(_gpa + 4096);
+    return *this;
+}
+
 mem_map::mem_map(kvm::vm& vm)
     : _vm(vm)
 {
@@ -81,3 +217,135 @@ mem_map::mem_map(kvm::vm& vm)
         _free_slots.push(i);
     }
 }
+
+unsigned mem_map::nr_free_slots() const
+{
+    return _free_slots.size();
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace {
+
+const char* backing_names[] = {
+    "anon", "thp", "hugetlb-2m", "hugetlb-1g", "memfd",
+};
+
+const int page_shifts[] = { 12, 21, 21, 30, 12 };
+
+}
+
+mem_backing::mem_backing(uint64_t size, type t, int node)
+    : _type(t), _size(), _addr(), _fd(-1)
+{
+    uint64_t align = page_size();
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    _size = (size + align - 1) & ~(align - 1);
+
+    switch (t) {
+    case hugetlb_2m:
+    case hugetlb_1g:
+        flags |= MAP_HUGETLB | (page_shifts[t] << MAP_HUGE_SHIFT);
+        break;
+    case memfd:
+        _fd = syscall(__NR_memfd_create, "mem_backing", 0);
+        if (_fd < 0 || ftruncate(_fd, _size) < 0) {
+            int err = errno;
+            if (_fd >= 0) {
+                close(_fd);
+            }
+            throw errno_exception(err);
+        }
+        flags = MAP_SHARED;
+        break;
+    default:
+        break;
+    }
+
+    // THP only kicks in for aligned 2M ranges, so over-allocate and trim.
+    uint64_t map_size = t == thp ? _size + align : _size;
+    void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, _fd, 0);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        throw errno_exception(err);
+    }
+    if (t == thp) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+        uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+        if (aligned != start) {
+            munmap(addr, aligned - start);
+        }
+        munmap(reinterpret_cast<void*>(aligned + _size),
+               start + map_size - (aligned + _size));
+        addr = reinterpret_cast<void*>(aligned);
+    }
+    _addr = addr;
+
+    if (t == anon || t == memfd) {
+        madvise(_addr, _size, MADV_NOHUGEPAGE);
+    } else if (t == thp) {
+        madvise(_addr, _size, MADV_HUGEPAGE);
+    }
+    if (node >= 0) {
+        try {
+            bind(node);
+        } catch (...) {
+            munmap(_addr, _size);
+            if (_fd >= 0) {
+                close(_fd);
+            }
+            throw;
+        }
+    }
+}
+
+mem_backing::~mem_backing()
+{
+    munmap(_addr, _size);
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+// Bind before the first touch, so that the pages are allocated on node.
+void mem_backing::bind(int node)
+{
+    typedef unsigned long ulong;
+    const int bits_per_word = sizeof(ulong) * 8;
+    ulong nodemask[1024 / bits_per_word] = { };
+
+    if (node >= 1024) {
+        throw errno_exception(EINVAL);
+    }
+    nodemask[node / bits_per_word] = 1UL << (node % bits_per_word);
+    if (syscall(__NR_mbind, _addr, _size, MPOL_BIND, nodemask, 1024,
+                MPOL_MF_STRICT) < 0) {
+        throw errno_exception(errno);
+    }
+}
+
+uint64_t mem_backing::page_size() const
+{
+    return 1ULL << page_shifts[_type];
+}
+
+const char* mem_backing::name(type t)
+{
+    return backing_names[t];
+}
+
+bool mem_backing::parse(const char* name, type& t)
+{
+    for (int i = 0; i < nr_types; ++i) {
+        if (strcmp(name, backing_names[i]) == 0) {
+            t = type(i);
+            return true;
+        }
+    }
+    return false;
+}
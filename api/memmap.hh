@@ -8,20 +8,76 @@
 
 class mem_map;
 class mem_slot;
+class mem_backing;
+
+// Host memory for guest slots: anonymous 4k pages, THP, hugetlbfs 2M or
+// 1G pages, or a memfd, optionally bound to a NUMA node.  The size is
+// rounded up to the backing's page size and the mapping is aligned to it,
+// so that KVM can map it with pages of the same size.
+class mem_backing {
+public:
+    enum type { anon, thp, hugetlb_2m, hugetlb_1g, memfd, nr_types };
+    mem_backing(uint64_t size, type t = anon, int node = -1);
+    ~mem_backing();
+    void* addr() const { return _addr; }
+    uint64_t size() const { return _size; }
+    uint64_t page_size() const;
+    type backing_type() const { return _type; }
+    static const char* name(type t);
+    static bool parse(const char* name, type& t);
+private:
+    mem_backing(const mem_backing&);
+    void bind(int node);
+private:
+    type _type;
+    uint64_t _size;
+    void* _addr;
+    int _fd;
+};
 
 class mem_slot {
+public:
+    // Walks the dirty pages of the last update_dirty_log(), in gpa order;
+    // dereferences to the gpa of the page.
+    class dirty_iterator {
+    public:
+        dirty_iterator(const mem_slot& slot, uint64_t gpa);
+        uint64_t operator*() const { return _gpa; }
+        dirty_iterator& operator++();
+        bool operator==(const dirty_iterator& x) const {
+            return _gpa == x._gpa;
+        }
+        bool operator!=(const dirty_iterator& x) const {
+            return _gpa != x._gpa;
+        }
+    private:
+        const mem_slot* _slot;
+        uint64_t _gpa;
+    };
 public:
     mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void *hva);
+    mem_slot(mem_map& map, uint64_t gpa, const mem_backing& backing);
     ~mem_slot();
+    void move(uint64_t gpa);
     void set_dirty_logging(bool enabled);
     bool dirty_logging() const;
     void update_dirty_log();
     bool is_dirty(uint64_t gpa) const;
+    // Queries on the whole slot, or on the pages overlapping
+    // [gpa, gpa + size); next_dirty() returns the end of the slot if no
+    // page at or above gpa is dirty.
+    uint64_t next_dirty(uint64_t gpa) const;
+    uint64_t nr_dirty() const;
+    uint64_t nr_dirty(uint64_t gpa, uint64_t size) const;
+    bool any_dirty(uint64_t gpa, uint64_t size) const;
+    dirty_iterator dirty_begin(uint64_t gpa = 0) const;
+    dirty_iterator dirty_end() const;
 private:
     void update();
 private:
     typedef unsigned long ulong;
     static const int bits_per_word = sizeof(ulong) * 8;
+    ulong skip_clean(ulong wordnr) const;
     mem_map& _map;
     int _slot;
     uint64_t _gpa;
@@ -34,6 +90,7 @@ private:
 class mem_map {
 public:
     mem_map(kvm::vm& vm);
+    unsigned nr_free_slots() const;
 private:
     kvm::vm& _vm;
     std::stack<int> _free_slots;
@@ -0,0 +1,255 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <boost/thread/thread.hpp>
+#include <tr1/memory>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Memslot scalability: for a growing number of slots, each step builds a
+// fresh vm whose guest memory is split evenly across that many slots and
+//  - times KVM_SET_USER_MEMORY_REGION adding, moving and deleting one
+//    more slot on top of them,
+//  - lets the vcpus fault in every page of the slots, stepping to the
+//    next slot on every access so that each fault looks up a different
+//    slot than the last one.
+// The host memory is populated once up front, so the faults only cost
+// KVM's side of the work.  It is 4k pages unless -b picks another
+// mem_backing, in which case the slots' pages may be mapped huge.
+
+namespace {
+
+const int page_size	= 4096;
+const int max_vcpus	= 64;
+const int nr_ops	= 32;
+// Where the extra slot goes, out of the way of the identity map.
+const uint64_t extra_gpa = 1ULL << 32;
+
+int64_t nr_total_pages	= 16 * 1024;
+unsigned max_slots	= 512;
+unsigned nr_vcpus	= 1;
+mem_backing::type backing = mem_backing::anon;
+int numa_node		= -1;
+
+char* mem_head;
+uint64_t guest_cycles[max_vcpus];
+
+typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | ((uint64_t)hi << 32);
+}
+
+// Touch page p of every slot for this vcpu's share of p.
+void touch_pages(unsigned id, unsigned nr_slots, int64_t slot_pages)
+{
+    uint64_t t0 = rdtsc();
+    for (int64_t p = id; p < slot_pages; p += nr_vcpus) {
+        for (unsigned s = 0; s < nr_slots; ++s) {
+            ++*(volatile char*)(mem_head + (s * slot_pages + p) * page_size);
+        }
+    }
+    guest_cycles[id] = rdtsc() - t0;
+}
+
+void run_vcpu(kvm::vcpu& vcpu)
+{
+    vcpu.run();
+}
+
+// Add, move and delete a slot on top of the ones already in memmap.
+void time_slot_ops(mem_map& memmap, uint64_t ns[3])
+{
+    ns[0] = ns[1] = ns[2] = 0;
+    for (int i = 0; i < nr_ops; ++i) {
+        uint64_t t0 = time_ns();
+        mem_slot* slot = new mem_slot(memmap, extra_gpa, page_size, mem_head);
+        uint64_t t1 = time_ns();
+        slot->move(extra_gpa + page_size);
+        uint64_t t2 = time_ns();
+        delete slot;
+        uint64_t t3 = time_ns();
+        ns[0] += t1 - t0;
+        ns[1] += t2 - t1;
+        ns[2] += t3 - t2;
+    }
+}
+
+using std::tr1::bind;
+
+void do_step(kvm::system& sys, unsigned nr_slots)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::hole hole(mem_head, nr_total_pages * page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    std::vector<mem_slot_ptr> slots;
+
+    int64_t slot_pages = nr_total_pages / nr_slots;
+    for (unsigned s = 0; s < nr_slots; ++s) {
+        char* hva = mem_head + s * slot_pages * page_size;
+        uint64_t gpa = reinterpret_cast<uintptr_t>(hva);
+        slots.push_back(mem_slot_ptr(new mem_slot(memmap, gpa,
+                                                  slot_pages * page_size,
+                                                  hva)));
+    }
+
+    uint64_t op_ns[3];
+    time_slot_ops(memmap, op_ns);
+
+    std::vector<kvm::vcpu*> vcpus;
+    std::vector<identity::vcpu*> guests;
+    for (unsigned i = 0; i < nr_vcpus; ++i) {
+        vcpus.push_back(new kvm::vcpu(vm, i));
+        guests.push_back(new identity::vcpu(*vcpus[i],
+                                            bind(touch_pages, i, nr_slots,
+                                                 slot_pages)));
+    }
+
+    uint64_t start_ns = time_ns();
+    std::vector<boost::thread*> threads;
+    for (unsigned i = 0; i < nr_vcpus; ++i) {
+        threads.push_back(new boost::thread(run_vcpu, boost::ref(*vcpus[i])));
+    }
+    uint64_t cycles = 0;
+    for (unsigned i = 0; i < nr_vcpus; ++i) {
+        threads[i]->join();
+        delete threads[i];
+        cycles += guest_cycles[i];
+    }
+    uint64_t fault_ns = time_ns() - start_ns;
+    uint64_t nr_faults = slot_pages * nr_slots;
+
+    for (unsigned i = 0; i < nr_vcpus; ++i) {
+        delete guests[i];
+        delete vcpus[i];
+    }
+
+    printf("%5u slots: add %6llu ns move %6llu ns delete %6llu ns, "
+           "fault %6llu cycles/page %6llu ns/page wall\n", nr_slots,
+           (unsigned long long)(op_ns[0] / nr_ops),
+           (unsigned long long)(op_ns[1] / nr_ops),
+           (unsigned long long)(op_ns[2] / nr_ops),
+           (unsigned long long)(cycles / nr_faults),
+           (unsigned long long)(fault_ns / nr_faults));
+}
+
+// How many slots are left once the identity map and the extra slot of
+// time_slot_ops() are in.
+unsigned usable_slots(kvm::system& sys)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::hole hole(mem_head, nr_total_pages * page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    return memmap.nr_free_slots() - 1;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "m:s:v:b:N:")) != -1) {
+        switch (opt) {
+        case 'm':
+            errno = 0;
+            nr_total_pages = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || nr_total_pages <= 0) {
+                printf("memslot-perf: Invalid number: -m %s\n", optarg);
+                exit(1);
+            }
+            if (*endptr == 'k' || *endptr == 'K') {
+                nr_total_pages *= 1024;
+            }
+            break;
+        case 's':
+            errno = 0;
+            max_slots = strtoul(optarg, &endptr, 10);
+            if (errno || endptr == optarg || !max_slots) {
+                printf("memslot-perf: Invalid number: -s %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v':
+            errno = 0;
+            nr_vcpus = strtoul(optarg, &endptr, 10);
+            if (errno || endptr == optarg || !nr_vcpus
+                || nr_vcpus > max_vcpus) {
+                printf("memslot-perf: Invalid number: -v %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (!mem_backing::parse(optarg, backing)) {
+                printf("memslot-perf: Invalid backing: -b %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            errno = 0;
+            numa_node = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || numa_node < 0) {
+                printf("memslot-perf: Invalid node: -N %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("memslot-perf: usage: memslot-perf [-m pages] "
+                   "[-s max slots] [-v vcpus] [-b backing] [-N node]\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+
+    // Populated now, so that none of the guest faults waits for the host.
+    mem_backing mem(nr_total_pages * page_size, backing, numa_node);
+    mem_head = static_cast<char*>(mem.addr());
+    memset(mem_head, 0, mem.size());
+
+    unsigned usable = usable_slots(sys);
+    if (max_slots > usable) {
+        max_slots = usable;
+    }
+    if (max_slots > nr_total_pages) {
+        max_slots = nr_total_pages;
+    }
+    printf("memslot-perf: %lld pages, up to %u slots, %u vcpus, %s\n",
+           (long long)nr_total_pages, max_slots, nr_vcpus,
+           mem_backing::name(backing));
+
+    for (unsigned n = 1; n < max_slots; n *= 2) {
+        do_step(sys, n);
+    }
+    do_step(sys, max_slots);
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,250 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include <boost/thread/thread.hpp>
+#include <tr1/memory>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// VM and vcpu setup latency: creates and destroys a vm with 1, 2, 4...
+// up to -c vcpus and -s extra one-page memslots, -i times per vcpu count,
+// and prints the average time of each phase in microseconds:
+//  vm:      KVM_CREATE_VM
+//  slots:   the identity map (TSS and three slots) plus the extra slots
+//  create:  KVM_CREATE_VCPU, summed over the vcpus
+//  mmap:    mapping the kvm_run area, summed over the vcpus
+//  regs:    KVM_SET_SREGS and KVM_SET_REGS, summed over the vcpus
+//  run:     the first KVM_RUN of a guest that returns at once, summed
+//  vcpus:   wall time of the four vcpu phases, which -t spreads over
+//           several threads
+//  destroy: tearing everything down
+//  total:   wall time of the whole iteration
+
+namespace {
+
+const int page_size	= 4096;
+const int max_vcpus	= 256;
+
+enum { create, mmap_run, regs, first_run, nr_vcpu_phases };
+
+unsigned nr_iterations	= 20;
+unsigned nr_vcpus	= 8;
+unsigned nr_slots	= 0;
+unsigned nr_threads	= 1;
+
+char* slot_mem;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+void guest_nop()
+{
+}
+
+struct vcpu_slot {
+    kvm::vcpu* vcpu;
+    identity::vcpu* guest;
+};
+
+// Set up and first run every nr_threads'th vcpu starting at first.
+void setup_vcpus(kvm::vm& vm, vcpu_slot* vcpus, unsigned n, unsigned first,
+                 uint64_t* ns)
+{
+    for (unsigned i = first; i < n; i += nr_threads) {
+        uint64_t t0 = time_ns();
+        vcpus[i].vcpu = new kvm::vcpu(vm, i, false);
+        uint64_t t1 = time_ns();
+        vcpus[i].vcpu->map_shared();
+        uint64_t t2 = time_ns();
+        vcpus[i].guest = new identity::vcpu(*vcpus[i].vcpu, guest_nop);
+        uint64_t t3 = time_ns();
+        vcpus[i].vcpu->run();
+        uint64_t t4 = time_ns();
+        ns[create] += t1 - t0;
+        ns[mmap_run] += t2 - t1;
+        ns[regs] += t3 - t2;
+        ns[first_run] += t4 - t3;
+    }
+}
+
+typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
+
+struct times {
+    uint64_t vm;
+    uint64_t slots;
+    uint64_t vcpu[nr_vcpu_phases];
+    uint64_t vcpus;
+    uint64_t destroy;
+    uint64_t total;
+};
+
+void one_vm(kvm::system& sys, unsigned n, times& t)
+{
+    uint64_t start = time_ns();
+    kvm::vm* vm = new kvm::vm(sys);
+    uint64_t t0 = time_ns();
+
+    mem_map* memmap = new mem_map(*vm);
+    identity::hole hole(slot_mem, nr_slots * page_size);
+    identity::vm* ident_vm = new identity::vm(*vm, *memmap, hole);
+    std::vector<mem_slot_ptr> slots;
+    for (unsigned s = 0; s < nr_slots; ++s) {
+        char* hva = slot_mem + s * page_size;
+        uint64_t gpa = reinterpret_cast<uintptr_t>(hva);
+        slots.push_back(mem_slot_ptr(new mem_slot(*memmap, gpa, page_size,
+                                                  hva)));
+    }
+    uint64_t t1 = time_ns();
+
+    vcpu_slot vcpus[max_vcpus];
+    uint64_t ns[max_vcpus][nr_vcpu_phases] = { };
+    boost::thread_group threads;
+    for (unsigned i = 1; i < nr_threads && i < n; ++i) {
+        threads.create_thread(std::tr1::bind(setup_vcpus, std::tr1::ref(*vm),
+                                             vcpus, n, i, ns[i]));
+    }
+    setup_vcpus(*vm, vcpus, n, 0, ns[0]);
+    threads.join_all();
+    uint64_t t2 = time_ns();
+
+    for (unsigned i = 0; i < n; ++i) {
+        delete vcpus[i].guest;
+        delete vcpus[i].vcpu;
+    }
+    slots.clear();
+    delete ident_vm;
+    delete memmap;
+    delete vm;
+    uint64_t end = time_ns();
+
+    t.vm += t0 - start;
+    t.slots += t1 - t0;
+    for (unsigned i = 0; i < nr_threads && i < n; ++i) {
+        for (int p = 0; p < nr_vcpu_phases; ++p) {
+            t.vcpu[p] += ns[i][p];
+        }
+    }
+    t.vcpus += t2 - t1;
+    t.destroy += end - t2;
+    t.total += end - start;
+}
+
+// How many slots are left once the identity map is in.
+unsigned usable_slots(kvm::system& sys)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::hole hole(slot_mem, nr_slots * page_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    return memmap.nr_free_slots();
+}
+
+unsigned long long avg_us(uint64_t ns)
+{
+    return ns / nr_iterations / 1000;
+}
+
+void do_test(kvm::system& sys, unsigned n)
+{
+    times t = { };
+
+    for (unsigned i = 0; i < nr_iterations; ++i) {
+        one_vm(sys, n, t);
+    }
+    printf("%5u %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+           n, avg_us(t.vm), avg_us(t.slots), avg_us(t.vcpu[create]),
+           avg_us(t.vcpu[mmap_run]), avg_us(t.vcpu[regs]),
+           avg_us(t.vcpu[first_run]), avg_us(t.vcpus), avg_us(t.destroy),
+           avg_us(t.total));
+}
+
+}
+
+unsigned parse_number(const char* opt, const char* arg, unsigned max)
+{
+    char *endptr;
+
+    errno = 0;
+    unsigned long n = strtoul(arg, &endptr, 10);
+    if (errno || endptr == arg || !n || n > max) {
+        printf("vm-create-perf: Invalid number: -%s %s\n", opt, arg);
+        exit(1);
+    }
+    return n;
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "i:c:s:t:")) != -1) {
+        switch (opt) {
+        case 'i':
+            nr_iterations = parse_number("i", optarg, 1000000);
+            break;
+        case 'c':
+            nr_vcpus = parse_number("c", optarg, max_vcpus);
+            break;
+        case 's':
+            nr_slots = parse_number("s", optarg, 1000000);
+            break;
+        case 't':
+            nr_threads = parse_number("t", optarg, max_vcpus);
+            break;
+        default:
+            printf("vm-create-perf: usage: vm-create-perf [-i iterations] "
+                   "[-c vcpus] [-s slots] [-t threads]\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+
+    unsigned max = sys.get_extension_int(KVM_CAP_MAX_VCPUS);
+    if (max && nr_vcpus > max) {
+        nr_vcpus = max;
+    }
+
+    if (nr_slots) {
+        void* mem;
+        if (posix_memalign(&mem, page_size, nr_slots * page_size)) {
+            printf("vm-create-perf: Could not allocate slot memory.\n");
+            exit(1);
+        }
+        slot_mem = static_cast<char*>(mem);
+
+        unsigned usable = usable_slots(sys);
+        if (nr_slots > usable) {
+            nr_slots = usable;
+        }
+    }
+
+    printf("vm-create-perf: %u iterations, %u slots, %u threads, "
+           "average us\n", nr_iterations, nr_slots, nr_threads);
+    printf("vcpus       vm    slots   create     mmap     regs      run"
+           "    vcpus  destroy    total\n");
+    for (unsigned n = 1; n < nr_vcpus; n *= 2) {
+        do_test(sys, n);
+    }
+    do_test(sys, nr_vcpus);
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -331,13 +331,50 @@ static bool psci_check(void)
 }
 
 static cpumask_t smp_reported;
-static void cpu_report(void)
+static void cpu_report(void *data __unused)
 {
 	int cpu = smp_processor_id();
 
 	report("CPU%d online", true, cpu);
 	cpumask_set_cpu(cpu, &smp_reported);
-	halt();
+}
+
+/*
+ * Print how long after the first CPU_ON it took for 1, 2, 4, ... and
+ * finally all of the secondaries to be online.
+ */
+static void smp_boot_times(void)
+{
+	u64 online[NR_CPUS], start = ~0ULL, tmp;
+	u32 frq = get_cntfrq();
+	int cpu, nr = 0, i, j;
+
+	for_each_present_cpu(cpu) {
+		if (cpu == 0)
+			continue;
+		if (secondary_data[cpu].boot_cnt < start)
+			start = secondary_data[cpu].boot_cnt;
+		online[nr++] = secondary_data[cpu].online_cnt;
+	}
+
+	for (i = 1; i < nr; ++i) {
+		tmp = online[i];
+		for (j = i; j > 0 && online[j - 1] > tmp; --j)
+			online[j] = online[j - 1];
+		online[j] = tmp;
+	}
+
+	if (!nr || !frq)
+		return;
+
+	for (i = 1; ; i *= 2) {
+		if (i > nr)
+			i = nr;
+		printf("%d secondaries online after %lu us\n", i,
+			(unsigned long)((online[i - 1] - start) * 1000000 / frq));
+		if (i == nr)
+			break;
+	}
 }
 
 int main(int argc, char **argv)
@@ -361,19 +398,13 @@ int main(int argc, char **argv)
 
 	} else if (strcmp(argv[0], "smp") == 0) {
 
-		int cpu;
-
 		report("PSCI version", psci_check());
 
-		for_each_present_cpu(cpu) {
-			if (cpu == 0)
-				continue;
-			smp_boot_secondary(cpu, cpu_report);
-		}
+		smp_boot_secondaries(do_idle);
+		on_cpus(cpu_report, NULL);
+		report("all cpus called", cpumask_full(&smp_reported));
 
-		cpumask_set_cpu(0, &smp_reported);
-		while (!cpumask_full(&smp_reported))
-			cpu_relax();
+		smp_boot_times();
 	} else {
 		printf("Unknown subtest\n");
 		abort();
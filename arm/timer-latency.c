@@ -0,0 +1,261 @@
+/*
+ * Generic timer interrupt latency
+ *
+ * Programs the virtual or physical timer for a deadline a little in the
+ * future, and in the interrupt handler reads the matching counter. The
+ * difference between that read and the programmed compare value is the
+ * timer injection latency, reported as min/percentiles/max per cpu.
+ * The cpu either waits for the interrupt in wfi (idle) or spins with
+ * interrupts enabled (busy).
+ *
+ * Usage: -append '[test...]' where test is one of virt-wfi, virt-busy,
+ * phys-wfi or phys-busy; without arguments all of them run.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <devicetree.h>
+#include <stats.h>
+#include <asm/processor.h>
+#include <asm/barrier.h>
+#include <asm/setup.h>
+#include <asm/smp.h>
+#include <asm/gic.h>
+
+#define NR_WARMUP		16
+#define NR_SAMPLES		1024
+#define PERIOD_US		200
+
+#define CNT_CTL_ENABLE		(1 << 0)
+
+struct timer {
+	const char *name;
+	int irq;
+	u64 (*read_counter)(void);
+	void (*write_cval)(u64 val);
+	void (*write_ctl)(u32 val);
+};
+
+struct test {
+	const char *name;
+	struct timer *timer;
+	bool wfi;
+};
+
+#ifdef __arm__
+static u64 read_cntpct(void)
+{
+	u64 cnt;
+	asm volatile("isb; mrrc p15, 0, %Q0, %R0, c14" : "=r" (cnt));
+	return cnt;
+}
+
+static void write_cntv_cval(u64 val)
+{
+	asm volatile("mcrr p15, 3, %Q0, %R0, c14; isb" : : "r" (val));
+}
+
+static void write_cntv_ctl(u32 val)
+{
+	asm volatile("mcr p15, 0, %0, c14, c3, 1; isb" : : "r" (val));
+}
+
+static void write_cntp_cval(u64 val)
+{
+	asm volatile("mcrr p15, 2, %Q0, %R0, c14; isb" : : "r" (val));
+}
+
+static void write_cntp_ctl(u32 val)
+{
+	asm volatile("mcr p15, 0, %0, c14, c2, 1; isb" : : "r" (val));
+}
+#else
+static u64 read_cntpct(void)
+{
+	u64 cnt;
+	asm volatile("isb; mrs %0, cntpct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+static void write_cntv_cval(u64 val)
+{
+	asm volatile("msr cntv_cval_el0, %0; isb" : : "r" (val));
+}
+
+static void write_cntv_ctl(u32 val)
+{
+	asm volatile("msr cntv_ctl_el0, %0; isb" : : "r" ((u64)val));
+}
+
+static void write_cntp_cval(u64 val)
+{
+	asm volatile("msr cntp_cval_el0, %0; isb" : : "r" (val));
+}
+
+static void write_cntp_ctl(u32 val)
+{
+	asm volatile("msr cntp_ctl_el0, %0; isb" : : "r" ((u64)val));
+}
+#endif
+
+/* mach-virt's PPIs, replaced by the ones in the device tree if found */
+static struct timer vtimer = {
+	"virt", GIC_PPI_BASE + 11, get_cntvct, write_cntv_cval, write_cntv_ctl,
+};
+static struct timer ptimer = {
+	"phys", GIC_PPI_BASE + 14, read_cntpct, write_cntp_cval, write_cntp_ctl,
+};
+
+static struct test tests[] = {
+	{ "virt-wfi", &vtimer, true },
+	{ "virt-busy", &vtimer, false },
+	{ "phys-wfi", &ptimer, true },
+	{ "phys-busy", &ptimer, false },
+};
+
+static u32 frq;
+static u64 samples[NR_SAMPLES];
+static struct timer *cur_timer;
+static volatile bool fired;
+static volatile u64 fired_cnt;
+
+static void timer_irq_handler(struct pt_regs *regs __unused)
+{
+	u64 now = cur_timer->read_counter();
+	u32 irqstat = gic_read_iar();
+	u32 irq = irqstat & GICC_IAR_INT_ID_MASK;
+
+	if (irq == GICC_INT_SPURIOUS)
+		return;
+
+	/* a late cross call SGI may land here too, just ack it */
+	if (irq == (u32)cur_timer->irq) {
+		cur_timer->write_ctl(0);
+		fired_cnt = now;
+		fired = true;
+	}
+	gic_write_eoir(irqstat);
+}
+
+static void measure(void *data)
+{
+	struct test *test = data;
+	struct timer *timer = test->timer;
+	u64 period = (u64)frq * PERIOD_US / 1000000, cval;
+	s64 delta;
+	int i;
+
+	cur_timer = timer;
+#ifdef __arm__
+	install_exception_handler(EXCPTN_IRQ, timer_irq_handler);
+#else
+	install_irq_handler(EL1H_IRQ, timer_irq_handler);
+#endif
+	local_irq_disable();
+	gic_enable_irq(timer->irq);
+
+	for (i = -NR_WARMUP; i < NR_SAMPLES; ++i) {
+		fired = false;
+		cval = timer->read_counter() + period;
+		timer->write_cval(cval);
+		timer->write_ctl(CNT_CTL_ENABLE);
+
+		if (test->wfi) {
+			/*
+			 * wfi wakes up for a pending interrupt even while
+			 * it's masked, it's then taken in the window below.
+			 */
+			while (!fired) {
+				wfi();
+				local_irq_enable();
+				local_irq_disable();
+			}
+		} else {
+			local_irq_enable();
+			while (!fired)
+				cpu_relax();
+			local_irq_disable();
+		}
+
+		if (i < 0)
+			continue;
+		delta = fired_cnt - cval;
+		samples[i] = delta > 0 ? delta * 1000000000 / frq : 0;
+	}
+
+	gic_disable_irq(timer->irq);
+}
+
+static void timer_irqs_init(void)
+{
+	static const char *compatible[] = {
+		"arm,armv8-timer",
+		"arm,armv7-timer",
+	};
+	const u32 *prop;
+	int node = -1, len;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(compatible) && node < 0; ++i)
+		node = fdt_node_offset_by_compatible(dt_fdt(), -1,
+						     compatible[i]);
+	if (node < 0)
+		return;
+
+	/* <type irq flags> for the secure, non-secure, virt, hyp timers */
+	prop = fdt_getprop(dt_fdt(), node, "interrupts", &len);
+	if (!prop || len < 9 * (int)sizeof(u32))
+		return;
+	ptimer.irq = GIC_PPI_BASE + fdt32_to_cpu(prop[4]);
+	vtimer.irq = GIC_PPI_BASE + fdt32_to_cpu(prop[7]);
+}
+
+static void do_test(struct test *test)
+{
+	char name[32];
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		on_cpu(cpu, measure, test);
+		snprintf(name, sizeof(name), "%s cpu %d ns", test->name, cpu);
+		stats_report(name, samples, NR_SAMPLES);
+	}
+}
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], test->name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	frq = get_cntfrq();
+	printf("counter frequency %u Hz, deadline %d us\n", frq, PERIOD_US);
+
+	smp_boot_secondaries(do_idle);
+	if (!gic_enable_defaults()) {
+		printf("no GICv2 cpu interface, skipping\n");
+		return 0;
+	}
+
+	timer_irqs_init();
+	printf("virt timer irq %d, phys timer irq %d\n",
+		vtimer.irq, ptimer.irq);
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], argv, argc))
+			do_test(&tests[i]);
+
+	return 0;
+}
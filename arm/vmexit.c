@@ -0,0 +1,228 @@
+/*
+ * Exit cost microbenchmarks, the arm/arm64 counterpart of x86/vmexit.c
+ *
+ * Each test doubles its iteration count until it has run for half a
+ * second of generic counter time, then prints the average cost of one
+ * iteration in nanoseconds.
+ *
+ * Usage: -append '[test...]'; without arguments every supported test
+ * runs. The ipi tests need smp >= 2.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <devicetree.h>
+#include <asm/processor.h>
+#include <asm/barrier.h>
+#include <asm/setup.h>
+#include <asm/psci.h>
+#include <asm/smp.h>
+#include <asm/gic.h>
+#include <asm/io.h>
+
+#define UARTFR			0x18
+#define VIRTIO_MMIO_MAGIC	0x000
+
+#define SGI_WAKE		2
+
+struct test {
+	void (*func)(void);
+	const char *name;
+	bool (*valid)(void);
+	int parallel;
+};
+
+static u64 goal;
+static u32 frq;
+static void *uart_base;
+static void *virtio_base;
+static volatile int woken;
+
+static void hvc(void)
+{
+	psci_invoke(PSCI_0_2_FN_PSCI_VERSION, 0, 0, 0);
+}
+
+/*
+ * ID registers are trapped when the host sets HCR_EL2.TID3, otherwise
+ * this measures a native system register read.
+ */
+static void sysreg_id(void)
+{
+	unsigned long val;
+
+#ifdef __arm__
+	asm volatile("mrc p15, 0, %0, c0, c1, 4" : "=r" (val));	/* ID_MMFR0 */
+#else
+	asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r" (val));
+#endif
+}
+
+static bool uart_valid(void)
+{
+	return uart_base != NULL;
+}
+
+static void mmio_pl011(void)
+{
+	readl(uart_base + UARTFR);
+}
+
+static bool virtio_valid(void)
+{
+	return virtio_base != NULL;
+}
+
+static void mmio_virtio(void)
+{
+	readl(virtio_base + VIRTIO_MMIO_MAGIC);
+}
+
+static bool sgi_valid(void)
+{
+	return gic_cpu_iface[smp_processor_id()] != 0;
+}
+
+static void sgi_ack(void)
+{
+	u32 irqstat = gic_read_iar();
+
+	if ((irqstat & GICC_IAR_INT_ID_MASK) != GICC_INT_SPURIOUS)
+		gic_write_eoir(irqstat);
+}
+
+/*
+ * SGI ourselves and wfi: the SGI is already pending, so this is the
+ * cost of the GICD_SGIR write and of a wfi that doesn't block.
+ */
+static void sgi_self_wfi(void)
+{
+	gic_ipi_send_single(SGI_WAKE, smp_processor_id());
+	wfi();
+	sgi_ack();
+}
+
+static bool ipi_valid(void)
+{
+	return nr_cpus > 1;
+}
+
+static void nop(void *data __unused)
+{
+}
+
+/* cross call round trip, cpu 1 wakes from wfi (or wfe) to run it */
+static void ipi(void)
+{
+	on_cpu(1, nop, NULL);
+}
+
+static bool ipi_wfi_valid(void)
+{
+	return ipi_valid() && sgi_valid() && gic_cpu_iface[1];
+}
+
+static void wake_cpu0(void *data __unused)
+{
+	woken = 1;
+	gic_ipi_send_single(SGI_WAKE, 0);
+}
+
+/* cpu 1 SGIs us back while we are blocked in wfi */
+static void ipi_wfi(void)
+{
+	woken = 0;
+	on_cpu_async(1, wake_cpu0, NULL);
+	while (!woken) {
+		wfi();
+		sgi_ack();
+	}
+}
+
+static struct test tests[] = {
+	{ hvc, "hvc", .parallel = 1, },
+	{ sysreg_id, "sysreg_id", .parallel = 1, },
+	{ mmio_pl011, "mmio_pl011", uart_valid, .parallel = 0, },
+	{ mmio_virtio, "mmio_virtio", virtio_valid, .parallel = 1, },
+	{ sgi_self_wfi, "sgi_self_wfi", sgi_valid, .parallel = 0, },
+	{ ipi, "ipi", ipi_valid, .parallel = 0, },
+	{ ipi_wfi, "ipi_wfi", ipi_wfi_valid, .parallel = 0, },
+};
+
+static unsigned long iterations;
+
+static void run_test(void *_func)
+{
+	void (*func)(void) = _func;
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		func();
+}
+
+static void do_test(struct test *test)
+{
+	unsigned long i;
+	u64 t1, t2;
+
+	iterations = 32;
+
+	if (test->valid && !test->valid()) {
+		printf("%s (skipped)\n", test->name);
+		return;
+	}
+
+	do {
+		iterations *= 2;
+		t1 = get_cntvct();
+
+		if (!test->parallel) {
+			for (i = 0; i < iterations; ++i)
+				test->func();
+		} else {
+			on_cpus(run_test, test->func);
+		}
+		t2 = get_cntvct();
+	} while ((t2 - t1) < goal);
+	printf("%s %lu ns\n", test->name,
+		(unsigned long)((t2 - t1) * 1000000000 / frq / iterations));
+}
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], test->name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	struct dt_pbus_reg base;
+	unsigned int i;
+
+	frq = get_cntfrq();
+	goal = frq / 2;
+	printf("counter frequency %u Hz\n", frq);
+
+	smp_boot_secondaries(do_idle);
+	gic_enable_defaults();
+	printf("ncpus = %d gic %s\n", nr_cpus, gicc_base ? "v2" : "none");
+
+	if (dt_pbus_get_base_compatible("arm,pl011", &base) == 0)
+		uart_base = ioremap(base.addr, base.size);
+	if (dt_pbus_get_base_compatible("virtio,mmio", &base) == 0)
+		virtio_base = ioremap(base.addr, base.size);
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], argv, argc))
+			do_test(&tests[i]);
+
+	return 0;
+}
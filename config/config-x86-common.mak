@@ -38,11 +38,18 @@ tests-common = $(TEST_DIR)/vmexit.flat $(TEST_DIR)/tsc.flat \
                $(TEST_DIR)/tsc_adjust.flat $(TEST_DIR)/asyncpf.flat \
                $(TEST_DIR)/init.flat $(TEST_DIR)/smap.flat \
                $(TEST_DIR)/hyperv_synic.flat $(TEST_DIR)/hyperv_stimer.flat \
+               $(TEST_DIR)/hypercall_latency.flat $(TEST_DIR)/ipi_latency.flat \
+               $(TEST_DIR)/hyperv_synic_bench.flat \
+               $(TEST_DIR)/exception_latency.flat \
 
 ifdef API
 tests-common += api/api-sample
 tests-common += api/dirty-log
 tests-common += api/dirty-log-perf
+tests-common += api/exit-perf
+tests-common += api/doorbell-perf
+tests-common += api/memslot-perf
+tests-common += api/vm-create-perf
 endif
 
 test_cases: $(tests-common) $(tests)
@@ -119,6 +126,16 @@ $(TEST_DIR)/hyperv_synic.elf: $(cstart.o) $(TEST_DIR)/hyperv.o \
 $(TEST_DIR)/hyperv_stimer.elf: $(cstart.o) $(TEST_DIR)/hyperv.o \
                                $(TEST_DIR)/hyperv_stimer.o
 
+$(TEST_DIR)/hyperv_synic_bench.elf: $(cstart.o) $(TEST_DIR)/hyperv.o \
+                                    $(TEST_DIR)/hyperv_synic_bench.o
+
+$(TEST_DIR)/hypercall_latency.elf: $(cstart.o) $(TEST_DIR)/hyperv.o \
+                                   $(TEST_DIR)/hypercall_latency.o
+
+$(TEST_DIR)/ipi_latency.elf: $(cstart.o) $(TEST_DIR)/ipi_latency.o
+
+$(TEST_DIR)/exception_latency.elf: $(cstart.o) $(TEST_DIR)/exception_latency.o
+
 $(TEST_DIR)/setjmp.elf: $(cstart.o) $(TEST_DIR)/setjmp.o
 
 arch_clean:
@@ -138,3 +155,11 @@ api/api-sample: api/api-sample.o api/libapi.a
 api/dirty-log: api/dirty-log.o api/libapi.a
 
 api/dirty-log-perf: api/dirty-log-perf.o api/libapi.a
+
+api/exit-perf: api/exit-perf.o api/libapi.a
+
+api/doorbell-perf: api/doorbell-perf.o api/libapi.a
+
+api/memslot-perf: api/memslot-perf.o api/libapi.a
+
+api/vm-create-perf: api/vm-create-perf.o api/libapi.a
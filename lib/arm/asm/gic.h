@@ -0,0 +1,65 @@
+#ifndef _ASMARM_GIC_H_
+#define _ASMARM_GIC_H_
+/*
+ * GICv2 distributor and cpu interface, just enough to send and take
+ * SGIs. GICv3 (and no GIC at all) is reported by gic_init() failing.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <asm/cpumask.h>
+
+#define GICD_CTLR			0x0000
+#define GICD_TYPER			0x0004
+#define GICD_ISENABLER			0x0100
+#define GICD_ICENABLER			0x0180
+#define GICD_IPRIORITYR			0x0400
+#define GICD_ITARGETSR			0x0800
+#define GICD_SGIR			0x0f00
+
+#define GICD_ENABLE			0x1
+#define GICD_SGI_TARGET_SHIFT		16
+
+#define GICC_CTLR			0x0000
+#define GICC_PMR			0x0004
+#define GICC_IAR			0x000c
+#define GICC_EOIR			0x0010
+
+#define GICC_ENABLE			0x1
+#define GICC_INT_PRI_THRESHOLD		0xf0
+#define GICC_IAR_INT_ID_MASK		0x3ff
+#define GICC_INT_SPURIOUS		1023
+
+#define GIC_NR_SGIS			16
+#define GIC_PPI_BASE			16
+#define GIC_MAX_CPU_IFACES		8
+
+extern void *gicd_base;
+extern void *gicc_base;
+
+/*
+ * gic_init looks the GICv2 up in the device tree and enables its
+ * distributor
+ * returns
+ *  - zero on success
+ *  - a negative FDT_ERR_* value when there is no usable GICv2
+ */
+extern int gic_init(void);
+
+/*
+ * gic_enable_defaults enables the calling cpu's interface and its SGIs,
+ * and returns its cpu interface mask (zero if it has none)
+ */
+extern u8 gic_enable_defaults(void);
+
+extern void gic_enable_irq(int irq);
+extern void gic_disable_irq(int irq);
+extern void gic_ipi_send_single(int irq, int cpu);
+extern void gic_ipi_send_mask(int irq, const cpumask_t *dest);
+extern u32 gic_read_iar(void);
+extern void gic_write_eoir(u32 irqstat);
+
+/* cpu interface mask of each cpu, set by its gic_enable_defaults() */
+extern u8 gic_cpu_iface[NR_CPUS];
+
+#endif /* _ASMARM_GIC_H_ */
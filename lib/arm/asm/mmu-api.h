@@ -16,6 +16,9 @@ extern void mmu_init_io_sect(pgd_t *pgtable, unsigned long virt_offset);
 extern void mmu_set_range_sect(pgd_t *pgtable, unsigned long virt_offset,
 			       unsigned long phys_start, unsigned long phys_end,
 			       pgprot_t prot);
+extern void mmu_set_range(pgd_t *pgtable, unsigned long virt_offset,
+			  unsigned long phys_start, unsigned long phys_end,
+			  pgprot_t prot);
 extern void mmu_set_range_ptes(pgd_t *pgtable, unsigned long virt_offset,
 			       unsigned long phys_start, unsigned long phys_end,
 			       pgprot_t prot);
@@ -33,6 +33,16 @@ static inline unsigned long current_cpsr(void)
 
 #define current_mode() (current_cpsr() & MODE_MASK)
 
+static inline void local_irq_enable(void)
+{
+	asm volatile("cpsie i" : : : "memory");
+}
+
+static inline void local_irq_disable(void)
+{
+	asm volatile("cpsid i" : : : "memory");
+}
+
 static inline unsigned int get_mpidr(void)
 {
 	unsigned int mpidr;
@@ -40,8 +50,22 @@ static inline unsigned int get_mpidr(void)
 	return mpidr;
 }
 
-/* Only support Aff0 for now, up to 4 cpus */
-#define mpidr_to_cpu(mpidr) ((int)((mpidr) & 0xff))
+extern int mpidr_to_cpu(unsigned long mpidr);
+
+/* generic timer virtual count and frequency */
+static inline u64 get_cntvct(void)
+{
+	u64 cnt;
+	asm volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r" (cnt));
+	return cnt;
+}
+
+static inline u32 get_cntfrq(void)
+{
+	u32 frq;
+	asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (frq));
+	return frq;
+}
 
 extern void start_usr(void (*func)(void *arg), void *arg, unsigned long sp_usr);
 extern bool is_user(void);
@@ -9,10 +9,15 @@
 #include <asm/page.h>
 #include <asm/pgtable-hwdef.h>
 
+#ifndef NR_CPUS
 #define NR_CPUS			8
+#endif
 extern u32 cpus[NR_CPUS];
 extern int nr_cpus;
 
+/* Aff2, Aff1 and Aff0, as found in the cpu nodes' reg property */
+#define MPIDR_HWID_BITMASK	0xffffff
+
 extern phys_addr_t __phys_offset, __phys_end;
 
 #define PHYS_OFFSET		(__phys_offset)
@@ -37,13 +37,31 @@ static inline void set_cpu_online(int cpu, bool online)
 
 typedef void (*secondary_entry_fn)(void);
 
-/* secondary_data is reused for each cpu, so only boot one at a time */
+/*
+ * Each cpu gets its own secondary_data, whose address is handed to
+ * secondary_entry as the PSCI CPU_ON context_id, so any number of cpus
+ * may be booting at once.
+ */
 struct secondary_data {
 	void *stack;		/* must be first member of struct */
 	secondary_entry_fn entry;
+	u64 boot_cnt;		/* counter when CPU_ON was issued */
+	u64 online_cnt;		/* counter when the cpu came online */
 };
-extern struct secondary_data secondary_data;
+extern struct secondary_data secondary_data[NR_CPUS];
 
 extern void smp_boot_secondary(int cpu, secondary_entry_fn entry);
+extern void smp_boot_secondary_nowait(int cpu, secondary_entry_fn entry);
+extern void smp_boot_secondaries(secondary_entry_fn entry);
+
+/*
+ * do_idle is the secondary_entry_fn for cpus that should take cross
+ * calls, it never returns. on_cpu and on_cpus wait for the calls to
+ * complete, on_cpu_async only waits for the target's previous call.
+ */
+extern void do_idle(void);
+extern void on_cpu_async(int cpu, void (*func)(void *data), void *data);
+extern void on_cpu(int cpu, void (*func)(void *data), void *data);
+extern void on_cpus(void (*func)(void *data), void *data);
 
 #endif /* _ASMARM_SMP_H_ */
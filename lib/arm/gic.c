@@ -0,0 +1,102 @@
+/*
+ * GICv2 support
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include <libcflat.h>
+#include <devicetree.h>
+#include <asm/io.h>
+#include <asm/barrier.h>
+#include <asm/smp.h>
+#include <asm/gic.h>
+
+void *gicd_base;
+void *gicc_base;
+u8 gic_cpu_iface[NR_CPUS];
+
+static const char *gicv2_compatible[] = {
+	"arm,cortex-a15-gic",
+	"arm,gic-400",
+};
+
+int gic_init(void)
+{
+	struct dt_pbus_reg dist, cpu;
+	int node = -FDT_ERR_NOTFOUND, ret;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(gicv2_compatible) && node < 0; ++i)
+		node = fdt_node_offset_by_compatible(dt_fdt(), -1,
+						     gicv2_compatible[i]);
+	if (node < 0)
+		return node;
+
+	ret = dt_pbus_translate_node(node, 0, &dist);
+	if (ret == 0)
+		ret = dt_pbus_translate_node(node, 1, &cpu);
+	if (ret)
+		return ret;
+
+	gicd_base = ioremap(dist.addr, dist.size);
+	gicc_base = ioremap(cpu.addr, cpu.size);
+
+	writel(GICD_ENABLE, gicd_base + GICD_CTLR);
+	return 0;
+}
+
+u8 gic_enable_defaults(void)
+{
+	int cpu = smp_processor_id();
+
+	if (!gicc_base)
+		return 0;
+
+	/* SGIs are banked per cpu, as is the first ITARGETSR word */
+	writel((1U << GIC_NR_SGIS) - 1, gicd_base + GICD_ISENABLER);
+	writel(GICC_INT_PRI_THRESHOLD, gicc_base + GICC_PMR);
+	writel(GICC_ENABLE, gicc_base + GICC_CTLR);
+
+	gic_cpu_iface[cpu] = readl(gicd_base + GICD_ITARGETSR) & 0xff;
+	return gic_cpu_iface[cpu];
+}
+
+/* PPIs are banked, so they must be enabled by the cpu that takes them */
+void gic_enable_irq(int irq)
+{
+	writel(1U << (irq % 32), gicd_base + GICD_ISENABLER + (irq / 32) * 4);
+}
+
+void gic_disable_irq(int irq)
+{
+	writel(1U << (irq % 32), gicd_base + GICD_ICENABLER + (irq / 32) * 4);
+}
+
+void gic_ipi_send_single(int irq, int cpu)
+{
+	assert(irq < GIC_NR_SGIS && gic_cpu_iface[cpu]);
+	writel(gic_cpu_iface[cpu] << GICD_SGI_TARGET_SHIFT | irq,
+	       gicd_base + GICD_SGIR);
+}
+
+void gic_ipi_send_mask(int irq, const cpumask_t *dest)
+{
+	u32 targets = 0;
+	int cpu;
+
+	assert(irq < GIC_NR_SGIS);
+	for_each_cpu(cpu, dest)
+		targets |= gic_cpu_iface[cpu];
+	if (targets)
+		writel(targets << GICD_SGI_TARGET_SHIFT | irq,
+		       gicd_base + GICD_SGIR);
+}
+
+u32 gic_read_iar(void)
+{
+	return readl(gicc_base + GICC_IAR);
+}
+
+void gic_write_eoir(u32 irqstat)
+{
+	writel(irqstat, gicc_base + GICC_EOIR);
+}
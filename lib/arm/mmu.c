@@ -8,6 +8,8 @@
 #include <asm/setup.h>
 #include <asm/thread_info.h>
 #include <asm/cpumask.h>
+#include <asm/spinlock.h>
+#include <asm/barrier.h>
 #include <asm/mmu.h>
 
 extern unsigned long etext;
@@ -17,6 +19,7 @@ pgd_t *mmu_idmap;
 /* CPU 0 starts with disabled MMU */
 static cpumask_t mmu_disabled_cpumask = { {1} };
 unsigned int mmu_disabled_cpu_count = 1;
+static struct spinlock mmu_disabled_lock;
 
 bool __mmu_enabled(void)
 {
@@ -32,16 +35,35 @@ bool __mmu_enabled(void)
 	return !cpumask_test_cpu(cpu, &mmu_disabled_cpumask);
 }
 
+/*
+ * Only called by @cpu itself, right after turning its MMU on. Until its
+ * bit is clear mmu_enabled() still says no, so the bitops would fall
+ * back to plain read-modify-write, which loses updates when secondaries
+ * come up in parallel. The MMU is on, so use exclusives directly.
+ */
 void mmu_mark_enabled(int cpu)
 {
-	if (cpumask_test_and_clear_cpu(cpu, &mmu_disabled_cpumask))
+	volatile unsigned long *word =
+		cpumask_bits(&mmu_disabled_cpumask) + BIT_WORD(cpu);
+	unsigned long mask = BIT_MASK(cpu), old;
+
+	smp_mb();
+	ATOMIC_TESTOP("bic", mask, word, old);
+	smp_mb();
+
+	if (old & mask) {
+		spin_lock(&mmu_disabled_lock);
 		--mmu_disabled_cpu_count;
+		spin_unlock(&mmu_disabled_lock);
+	}
 }
 
 void mmu_mark_disabled(int cpu)
 {
+	spin_lock(&mmu_disabled_lock);
 	if (!cpumask_test_and_set_cpu(cpu, &mmu_disabled_cpumask))
 		++mmu_disabled_cpu_count;
+	spin_unlock(&mmu_disabled_lock);
 }
 
 extern void asm_mmu_enable(phys_addr_t pgtable);
@@ -65,6 +87,35 @@ void mmu_disable(void)
 	asm_mmu_disable();
 }
 
+/*
+ * Fill the ptes for [vaddr, virt_end), which must lie within the
+ * single last-level table that @pmd points to, allocating the table
+ * if needed. The table is only looked up once per call.
+ */
+static void mmu_set_ptes(pmd_t *pmd, unsigned long vaddr,
+			 unsigned long virt_end, unsigned long paddr,
+			 pgprot_t prot)
+{
+	pte_t *pte = pte_alloc(pmd, vaddr);
+
+	for (; vaddr < virt_end; vaddr += PAGE_SIZE, paddr += PAGE_SIZE) {
+		pte_val(*pte) = paddr;
+		pte_val(*pte) |= PTE_TYPE_PAGE | PTE_AF | PTE_SHARED;
+		pte_val(*pte) |= pgprot_val(prot);
+		++pte;
+	}
+}
+
+/* the end of the PMD_SIZE region containing vaddr, or virt_end */
+static unsigned long pmd_range_end(unsigned long vaddr,
+				   unsigned long virt_end)
+{
+	unsigned long next = (vaddr & PMD_MASK) + PMD_SIZE;
+
+	/* next may have wrapped to zero at the top of the address space */
+	return next - 1 < virt_end - 1 ? next : virt_end;
+}
+
 void mmu_set_range_ptes(pgd_t *pgtable, unsigned long virt_offset,
 			unsigned long phys_start, unsigned long phys_end,
 			pgprot_t prot)
@@ -72,16 +123,62 @@ void mmu_set_range_ptes(pgd_t *pgtable, unsigned long virt_offset,
 	unsigned long vaddr = virt_offset & PAGE_MASK;
 	unsigned long paddr = phys_start & PAGE_MASK;
 	unsigned long virt_end = phys_end - paddr + vaddr;
+	unsigned long next;
 
-	for (; vaddr < virt_end; vaddr += PAGE_SIZE, paddr += PAGE_SIZE) {
+	for (; vaddr < virt_end; paddr += next - vaddr, vaddr = next) {
 		pgd_t *pgd = pgd_offset(pgtable, vaddr);
 		pud_t *pud = pud_alloc(pgd, vaddr);
 		pmd_t *pmd = pmd_alloc(pud, vaddr);
-		pte_t *pte = pte_alloc(pmd, vaddr);
 
-		pte_val(*pte) = paddr;
-		pte_val(*pte) |= PTE_TYPE_PAGE | PTE_AF | PTE_SHARED;
-		pte_val(*pte) |= pgprot_val(prot);
+		next = pmd_range_end(vaddr, virt_end);
+		mmu_set_ptes(pmd, vaddr, next, paddr, prot);
+	}
+}
+
+/*
+ * Like mmu_set_range_ptes(), but use PGDIR_SIZE sections and PMD_SIZE
+ * blocks wherever the addresses are suitably aligned and nothing is
+ * mapped there yet, falling back to pages only at the unaligned edges.
+ * @prot takes the same PTE_* attributes, which block descriptors share.
+ */
+void mmu_set_range(pgd_t *pgtable, unsigned long virt_offset,
+		   unsigned long phys_start, unsigned long phys_end,
+		   pgprot_t prot)
+{
+	unsigned long vaddr = virt_offset & PAGE_MASK;
+	unsigned long paddr = phys_start & PAGE_MASK;
+	unsigned long virt_end = phys_end - paddr + vaddr;
+	unsigned long next;
+
+	for (; vaddr < virt_end; paddr += next - vaddr, vaddr = next) {
+		pgd_t *pgd = pgd_offset(pgtable, vaddr);
+		pud_t *pud;
+		pmd_t *pmd;
+
+		if (pgd_none(*pgd) && !((vaddr | paddr) & ~PGDIR_MASK)
+				&& virt_end - vaddr >= PGDIR_SIZE) {
+			pgd_val(*pgd) = paddr;
+			pgd_val(*pgd) |= PMD_TYPE_SECT | PMD_SECT_AF | PMD_SECT_S;
+			pgd_val(*pgd) |= pgprot_val(prot);
+			next = vaddr + PGDIR_SIZE;
+			continue;
+		}
+
+		pud = pud_alloc(pgd, vaddr);
+		pmd = pmd_alloc(pud, vaddr);
+		next = pmd_range_end(vaddr, virt_end);
+
+		/* folded pmd: the pgd check above already covered blocks */
+		if (PMD_SIZE != PGDIR_SIZE && pmd_none(*pmd)
+				&& !((vaddr | paddr) & ~PMD_MASK)
+				&& next - vaddr == PMD_SIZE) {
+			pmd_val(*pmd) = paddr;
+			pmd_val(*pmd) |= PMD_TYPE_SECT | PMD_SECT_AF | PMD_SECT_S;
+			pmd_val(*pmd) |= pgprot_val(prot);
+			continue;
+		}
+
+		mmu_set_ptes(pmd, vaddr, next, paddr, prot);
 	}
 }
 
@@ -119,12 +216,16 @@ void mmu_enable_idmap(void)
 
 	mmu_init_io_sect(mmu_idmap, PHYS_IO_OFFSET);
 
-	/* armv8 requires code shared between EL1 and EL0 to be read-only */
-	mmu_set_range_ptes(mmu_idmap, PHYS_OFFSET,
+	/*
+	 * armv8 requires code shared between EL1 and EL0 to be read-only.
+	 * Only the region around the end of the code needs to be mapped
+	 * with pages, the rest of memory uses blocks.
+	 */
+	mmu_set_range(mmu_idmap, PHYS_OFFSET,
 		PHYS_OFFSET, code_end,
 		__pgprot(PTE_WBWA | PTE_RDONLY | PTE_USER));
 
-	mmu_set_range_ptes(mmu_idmap, code_end,
+	mmu_set_range(mmu_idmap, code_end,
 		code_end, phys_end,
 		__pgprot(PTE_WBWA | PTE_USER));
 
@@ -9,6 +9,7 @@
 #include <asm/psci.h>
 #include <asm/setup.h>
 #include <asm/page.h>
+#include <asm/smp.h>
 
 #define T PSCI_INVOKE_ARG_TYPE
 __attribute__((noinline))
@@ -21,15 +22,21 @@ int psci_invoke(T function_id, T arg0, T arg1, T arg2)
 	return function_id;
 }
 
-int psci_cpu_on(unsigned long cpuid, unsigned long entry_point)
+int psci_cpu_on(unsigned long cpuid, unsigned long entry_point,
+		unsigned long context_id)
 {
-	return psci_invoke(PSCI_FN_CPU_ON, cpuid, entry_point, 0);
+	return psci_invoke(PSCI_FN_CPU_ON, cpuid, entry_point, context_id);
 }
 
+/*
+ * secondary_entry receives the cpu's own secondary_data through the
+ * CPU_ON context_id, so several cpus may be booting at the same time.
+ */
 extern void secondary_entry(void);
 int cpu_psci_cpu_boot(unsigned int cpu)
 {
-	int err = psci_cpu_on(cpus[cpu], __pa(secondary_entry));
+	int err = psci_cpu_on(cpus[cpu], __pa(secondary_entry),
+			      __pa(&secondary_data[cpu]));
 	if (err)
 		printf("failed to boot CPU%d (%d)\n", cpu, err);
 	return err;
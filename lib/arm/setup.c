@@ -37,6 +37,22 @@ static void cpu_set(int fdtnode __unused, u32 regval, void *info __unused)
 	set_cpu_present(cpu, true);
 }
 
+/*
+ * Map an MPIDR to its logical cpu number by looking its affinity
+ * fields up in cpus[], so cpus beyond the first Aff0 cluster work.
+ */
+int mpidr_to_cpu(unsigned long mpidr)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; ++cpu)
+		if (cpus[cpu] == (mpidr & MPIDR_HWID_BITMASK))
+			return cpu;
+
+	/* cpus[] isn't filled in yet, assume the old Aff0 numbering */
+	return mpidr & 0xff;
+}
+
 static void cpu_init(void)
 {
 	int ret;
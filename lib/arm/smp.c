@@ -9,15 +9,17 @@
 #include <asm/thread_info.h>
 #include <asm/cpumask.h>
 #include <asm/barrier.h>
+#include <asm/processor.h>
 #include <asm/mmu.h>
 #include <asm/psci.h>
+#include <asm/gic.h>
 #include <asm/smp.h>
 
 cpumask_t cpu_present_mask;
 cpumask_t cpu_online_mask;
-struct secondary_data secondary_data;
+struct secondary_data secondary_data[NR_CPUS];
 
-secondary_entry_fn secondary_cinit(void)
+secondary_entry_fn secondary_cinit(struct secondary_data *data)
 {
 	struct thread_info *ti = current_thread_info();
 	secondary_entry_fn entry;
@@ -26,10 +28,11 @@ secondary_entry_fn secondary_cinit(void)
 	mmu_mark_enabled(ti->cpu);
 
 	/*
-	 * Save secondary_data.entry locally to avoid opening a race
-	 * window between marking ourselves online and calling it.
+	 * Save data->entry locally to avoid opening a race window
+	 * between marking ourselves online and calling it.
 	 */
-	entry = secondary_data.entry;
+	entry = data->entry;
+	data->online_cnt = get_cntvct();
 	set_cpu_online(ti->cpu, true);
 	sev();
 
@@ -40,16 +43,203 @@ secondary_entry_fn secondary_cinit(void)
 	return entry;
 }
 
-void smp_boot_secondary(int cpu, secondary_entry_fn entry)
+/*
+ * Issue CPU_ON for @cpu and return without waiting for it to come
+ * online. The caller must mark the cpu's MMU disabled beforehand.
+ */
+static void __smp_boot_secondary(int cpu, secondary_entry_fn entry)
 {
+	struct secondary_data *data = &secondary_data[cpu];
 	int ret;
 
-	secondary_data.stack = thread_stack_alloc();
-	secondary_data.entry = entry;
-	mmu_mark_disabled(cpu);
+	data->stack = thread_stack_alloc();
+	data->entry = entry;
+	data->online_cnt = 0;
+	data->boot_cnt = get_cntvct();
 	ret = cpu_psci_cpu_boot(cpu);
 	assert(ret == 0);
+}
+
+static void ipi_init(void);
+
+void smp_boot_secondary_nowait(int cpu, secondary_entry_fn entry)
+{
+	ipi_init();
+	mmu_mark_disabled(cpu);
+	__smp_boot_secondary(cpu, entry);
+}
+
+void smp_boot_secondary(int cpu, secondary_entry_fn entry)
+{
+	smp_boot_secondary_nowait(cpu, entry);
 
 	while (!cpu_online(cpu))
 		wfe();
 }
+
+/*
+ * Boot every present cpu that isn't online yet. CPU_ON is issued to
+ * all of them before waiting on any, so their bring-up overlaps and
+ * the total boot time no longer grows with the number of cpus.
+ */
+void smp_boot_secondaries(secondary_entry_fn entry)
+{
+	cpumask_t booting;
+	int cpu;
+
+	ipi_init();
+	cpumask_clear(&booting);
+	for_each_present_cpu(cpu) {
+		if (!cpu_online(cpu)) {
+			cpumask_set_cpu(cpu, &booting);
+			mmu_mark_disabled(cpu);
+		}
+	}
+
+	for_each_cpu(cpu, &booting)
+		__smp_boot_secondary(cpu, entry);
+
+	for_each_cpu(cpu, &booting)
+		while (!cpu_online(cpu))
+			wfe();
+}
+
+/*
+ * Cross calls. Each cpu has a one-entry mailbox, which the sender fills
+ * before ringing the target's doorbell. The doorbell is an SGI when the
+ * target has a GICv2 cpu interface, otherwise an event (sev). Targets
+ * wait in do_idle() with interrupts masked, so a pending SGI wakes them
+ * from wfi without going through the exception vectors, and the call
+ * runs on the cpu's normal stack.
+ */
+#define SGI_CALL_FUNC		1
+
+struct on_cpu_info {
+	void (*func)(void *data);
+	void *data;
+	volatile int pending;
+} __attribute__((aligned(SMP_CACHE_BYTES)));
+
+static struct on_cpu_info on_cpu_info[NR_CPUS];
+static bool ipi_initialized;
+
+static void ipi_init(void)
+{
+	if (ipi_initialized)
+		return;
+	gic_init();
+	ipi_initialized = true;
+}
+
+static void ipi_ack(void)
+{
+	u32 irqstat = gic_read_iar();
+
+	if ((irqstat & GICC_IAR_INT_ID_MASK) != GICC_INT_SPURIOUS)
+		gic_write_eoir(irqstat);
+}
+
+void do_idle(void)
+{
+	int cpu = smp_processor_id();
+	struct on_cpu_info *info = &on_cpu_info[cpu];
+	bool sgi;
+
+	local_irq_disable();
+	sgi = gic_enable_defaults() != 0;
+
+	/* pairs with the barrier between pending and the iface check */
+	smp_mb();
+
+	for (;;) {
+		while (!info->pending) {
+			if (sgi) {
+				wfi();
+				ipi_ack();
+			} else {
+				wfe();
+			}
+		}
+		smp_rmb();
+		info->func(info->data);
+		smp_mb();
+		info->pending = 0;
+		sev();
+	}
+}
+
+static void on_cpu_post(int cpu, void (*func)(void *data), void *data)
+{
+	struct on_cpu_info *info = &on_cpu_info[cpu];
+
+	/* the mailbox only holds one call, wait for the last one */
+	while (info->pending)
+		wfe();
+
+	info->func = func;
+	info->data = data;
+	smp_wmb();
+	info->pending = 1;
+	smp_mb();
+}
+
+static void on_cpu_wait(int cpu)
+{
+	while (on_cpu_info[cpu].pending)
+		wfe();
+}
+
+void on_cpu_async(int cpu, void (*func)(void *data), void *data)
+{
+	assert(cpu != smp_processor_id());
+
+	on_cpu_post(cpu, func, data);
+	if (gic_cpu_iface[cpu])
+		gic_ipi_send_single(SGI_CALL_FUNC, cpu);
+	else
+		sev();
+}
+
+void on_cpu(int cpu, void (*func)(void *data), void *data)
+{
+	if (cpu == smp_processor_id()) {
+		func(data);
+		return;
+	}
+
+	on_cpu_async(cpu, func, data);
+	on_cpu_wait(cpu);
+}
+
+/*
+ * Run @func on every online cpu, the caller included, and return once
+ * all of them have finished. The other cpus must be in do_idle().
+ */
+void on_cpus(void (*func)(void *data), void *data)
+{
+	int me = smp_processor_id(), cpu;
+	cpumask_t targets;
+	bool need_sev = false;
+
+	cpumask_clear(&targets);
+	for_each_online_cpu(cpu) {
+		if (cpu == me)
+			continue;
+		on_cpu_post(cpu, func, data);
+		if (gic_cpu_iface[cpu])
+			cpumask_set_cpu(cpu, &targets);
+		else
+			need_sev = true;
+	}
+
+	if (!cpumask_empty(&targets))
+		gic_ipi_send_mask(SGI_CALL_FUNC, &targets);
+	if (need_sev)
+		sev();
+
+	func(data);
+
+	for_each_online_cpu(cpu)
+		if (cpu != me)
+			on_cpu_wait(cpu);
+}
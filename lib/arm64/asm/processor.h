@@ -66,6 +66,16 @@ static inline unsigned long current_level(void)
 	return el & 0xc;
 }
 
+static inline void local_irq_enable(void)
+{
+	asm volatile("msr daifclr, #2" : : : "memory");
+}
+
+static inline void local_irq_disable(void)
+{
+	asm volatile("msr daifset, #2" : : : "memory");
+}
+
 #define DEFINE_GET_SYSREG32(reg)				\
 static inline unsigned int get_##reg(void)			\
 {								\
@@ -75,8 +85,22 @@ static inline unsigned int get_##reg(void)			\
 }
 DEFINE_GET_SYSREG32(mpidr)
 
-/* Only support Aff0 for now, gicv2 only */
-#define mpidr_to_cpu(mpidr) ((int)((mpidr) & 0xff))
+extern int mpidr_to_cpu(unsigned long mpidr);
+
+/* generic timer virtual count and frequency */
+static inline u64 get_cntvct(void)
+{
+	u64 cnt;
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+static inline u32 get_cntfrq(void)
+{
+	u64 frq;
+	asm volatile("mrs %0, cntfrq_el0" : "=r" (frq));
+	return frq;
+}
 
 extern void start_usr(void (*func)(void *arg), void *arg, unsigned long sp_usr);
 extern bool is_user(void);
@@ -1 +1,2 @@
+#define NR_CPUS			256
 #include "../../arm/asm/setup.h"
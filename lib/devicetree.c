@@ -10,6 +10,170 @@
 static const void *fdt;
 static u32 root_nr_address_cells, root_nr_size_cells;
 
+/*
+ * dt_index is built by a single pass over the fdt at dt_init() time, so
+ * that lookups by compatible string, phandle and node type don't have
+ * to rescan the whole tree through libfdt on every call. It has to be
+ * static, as dt_init() runs before memory allocation is available. If
+ * the tree doesn't fit, the index is left invalid and every lookup
+ * falls back to walking the fdt.
+ */
+#define DT_INDEX_MAX_NODES	2048
+#define DT_INDEX_MAX_COMPAT	4096
+#define DT_INDEX_HASH_SIZE	256
+
+#define DT_NODE_MEMORY		(1U << 0)
+#define DT_NODE_CPUS_CHILD	(1U << 1)
+#define DT_NODE_CPU		(1U << 2)
+#define DT_NODE_NO_TYPE		(1U << 3)
+
+struct dt_index_node {
+	int fdtnode;
+	u32 phandle;
+	u32 flags;
+	int next_phandle;
+};
+
+struct dt_index_compat {
+	const char *compatible;
+	int node;
+	int next;
+};
+
+static struct {
+	bool valid;
+	int nr_nodes, nr_compat;
+	struct dt_index_node nodes[DT_INDEX_MAX_NODES];
+	struct dt_index_compat compat[DT_INDEX_MAX_COMPAT];
+	int compat_head[DT_INDEX_HASH_SIZE];
+	int compat_tail[DT_INDEX_HASH_SIZE];
+	int phandle_head[DT_INDEX_HASH_SIZE];
+	int console;
+} dt_index;
+
+static unsigned dt_index_hash(const char *str)
+{
+	unsigned hash = 5381;
+
+	while (*str)
+		hash = hash * 33 + *str++;
+	return hash % DT_INDEX_HASH_SIZE;
+}
+
+static int dt_index_add_compat(int idx, const char *compatible)
+{
+	unsigned hash = dt_index_hash(compatible);
+	struct dt_index_compat *c;
+	int n = dt_index.nr_compat;
+
+	if (n == DT_INDEX_MAX_COMPAT)
+		return -FDT_ERR_NOSPACE;
+
+	c = &dt_index.compat[n];
+	c->compatible = compatible;
+	c->node = idx;
+	c->next = -1;
+
+	/* append, so each chain stays in fdt order */
+	if (dt_index.compat_tail[hash] < 0)
+		dt_index.compat_head[hash] = n;
+	else
+		dt_index.compat[dt_index.compat_tail[hash]].next = n;
+	dt_index.compat_tail[hash] = n;
+
+	++dt_index.nr_compat;
+	return 0;
+}
+
+static int dt_index_add_node(int fdtnode, bool cpus_child)
+{
+	struct dt_index_node *node;
+	const char *name, *str, *end;
+	int idx = dt_index.nr_nodes, off, len, ret;
+	const void *data;
+	unsigned hash;
+
+	if (idx == DT_INDEX_MAX_NODES)
+		return -FDT_ERR_NOSPACE;
+
+	node = &dt_index.nodes[idx];
+	node->fdtnode = fdtnode;
+	node->phandle = 0;
+	node->flags = DT_NODE_NO_TYPE;
+	node->next_phandle = -1;
+
+	if (cpus_child)
+		node->flags |= DT_NODE_CPUS_CHILD;
+
+	/* a single pass over the properties rather than a lookup per name */
+	for (off = fdt_first_property_offset(fdt, fdtnode); off >= 0;
+	     off = fdt_next_property_offset(fdt, off)) {
+
+		data = fdt_getprop_by_offset(fdt, off, &name, &len);
+		if (data == NULL)
+			return len;
+
+		if (!strcmp(name, "compatible")) {
+			str = data;
+			end = str + len;
+			while (str < end) {
+				ret = dt_index_add_compat(idx, str);
+				if (ret < 0)
+					return ret;
+				str += strlen(str) + 1;
+			}
+		} else if (!strcmp(name, "device_type")) {
+			node->flags &= ~DT_NODE_NO_TYPE;
+			if (len == 4 && !strcmp(data, "cpu"))
+				node->flags |= DT_NODE_CPU;
+			else if (len == 7 && !strcmp(data, "memory"))
+				node->flags |= DT_NODE_MEMORY;
+		} else if (len == sizeof(u32) && (!strcmp(name, "phandle") ||
+				!strcmp(name, "linux,phandle"))) {
+			node->phandle = fdt32_to_cpu(*(u32 *)data);
+		}
+	}
+
+	if (node->phandle) {
+		hash = node->phandle % DT_INDEX_HASH_SIZE;
+		node->next_phandle = dt_index.phandle_head[hash];
+		dt_index.phandle_head[hash] = idx;
+	}
+
+	++dt_index.nr_nodes;
+	return 0;
+}
+
+static int __dt_get_default_console_node(void);
+
+static void dt_index_build(void)
+{
+	int node, depth = 0, cpus, i, ret;
+	bool in_cpus = false;
+
+	dt_index.valid = false;
+	dt_index.nr_nodes = dt_index.nr_compat = 0;
+	for (i = 0; i < DT_INDEX_HASH_SIZE; ++i) {
+		dt_index.compat_head[i] = -1;
+		dt_index.compat_tail[i] = -1;
+		dt_index.phandle_head[i] = -1;
+	}
+
+	cpus = fdt_path_offset(fdt, "/cpus");
+
+	for (node = 0; node >= 0; node = fdt_next_node(fdt, node, &depth)) {
+		/* the root is depth 0, so /cpus is 1 and its children 2 */
+		if (depth == 1)
+			in_cpus = node == cpus;
+		ret = dt_index_add_node(node, in_cpus && depth == 2);
+		if (ret < 0)
+			return;
+	}
+
+	dt_index.console = __dt_get_default_console_node();
+	dt_index.valid = true;
+}
+
 const void *dt_fdt(void)
 {
 	return fdt;
@@ -131,7 +295,24 @@ void dt_device_init(struct dt_device *dev, const struct dt_bus *bus,
 int dt_device_find_compatible(const struct dt_device *dev,
 			      const char *compatible)
 {
-	int node, ret;
+	struct dt_index_compat *c;
+	int n, node, ret;
+
+	if (dt_index.valid) {
+		n = dt_index.compat_head[dt_index_hash(compatible)];
+		for (; n >= 0; n = c->next) {
+			c = &dt_index.compat[n];
+			if (strcmp(c->compatible, compatible))
+				continue;
+			node = dt_index.nodes[c->node].fdtnode;
+			ret = dev->bus->match(dev, node);
+			if (ret < 0)
+				return ret;
+			else if (ret)
+				return node;
+		}
+		return -FDT_ERR_NOTFOUND;
+	}
 
 	node = fdt_node_offset_by_compatible(fdt, -1, compatible);
 	while (node >= 0) {
@@ -162,26 +343,50 @@ int dt_pbus_get_base_compatible(const char *compatible,
 	return dt_pbus_get_base(&dev, base);
 }
 
+static int dt_get_memory_node_params(int node, struct dt_pbus_reg *regs,
+				     int nr, int nr_regs)
+{
+	struct dt_pbus_reg reg;
+	int ret;
+
+	while (nr < nr_regs) {
+		ret = dt_pbus_translate_node(node, nr, &reg);
+		if (ret == -FDT_ERR_NOTFOUND)
+			break;
+		if (ret < 0)
+			return ret;
+		regs[nr].addr = reg.addr;
+		regs[nr].size = reg.size;
+		++nr;
+	}
+
+	return nr;
+}
+
 int dt_get_memory_params(struct dt_pbus_reg *regs, int nr_regs)
 {
 	const char *pn = "device_type", *pv = "memory";
-	int node, ret, pl = strlen(pv) + 1, nr = 0;
-	struct dt_pbus_reg reg;
+	int node, pl = strlen(pv) + 1, nr = 0, i;
+
+	if (dt_index.valid) {
+		for (i = 0; i < dt_index.nr_nodes; ++i) {
+			if (!(dt_index.nodes[i].flags & DT_NODE_MEMORY))
+				continue;
+			nr = dt_get_memory_node_params(dt_index.nodes[i].fdtnode,
+						       regs, nr, nr_regs);
+			if (nr < 0)
+				return nr;
+		}
+		return nr;
+	}
 
 	node = fdt_node_offset_by_prop_value(fdt, -1, pn, pv, pl);
 
 	while (node >= 0) {
 
-		while (nr < nr_regs) {
-			ret = dt_pbus_translate_node(node, nr, &reg);
-			if (ret == -FDT_ERR_NOTFOUND)
-				break;
-			if (ret < 0)
-				return ret;
-			regs[nr].addr = reg.addr;
-			regs[nr].size = reg.size;
-			++nr;
-		}
+		nr = dt_get_memory_node_params(node, regs, nr, nr_regs);
+		if (nr < 0)
+			return nr;
 
 		node = fdt_node_offset_by_prop_value(fdt, node, pn, pv, pl);
 	}
@@ -193,9 +398,9 @@ int dt_for_each_cpu_node(void (*func)(int fdtnode, u32 regval, void *info),
 			 void *info)
 {
 	const struct fdt_property *prop;
-	int cpus, cpu, ret, len;
+	int cpus, cpu, ret, len, i;
 	struct dt_reg raw_reg;
-	u32 nac, nsc;
+	u32 nac, nsc, flags;
 
 	cpus = fdt_path_offset(fdt, "/cpus");
 	if (cpus < 0)
@@ -207,6 +412,26 @@ int dt_for_each_cpu_node(void (*func)(int fdtnode, u32 regval, void *info),
 
 	dt_reg_init(&raw_reg, nac, nsc);
 
+	if (dt_index.valid) {
+		for (i = 0; i < dt_index.nr_nodes; ++i) {
+			flags = dt_index.nodes[i].flags;
+			if (!(flags & DT_NODE_CPUS_CHILD))
+				continue;
+			if (flags & DT_NODE_NO_TYPE)
+				return -FDT_ERR_NOTFOUND;
+			if (!(flags & DT_NODE_CPU))
+				continue;
+
+			cpu = dt_index.nodes[i].fdtnode;
+			ret = dt_get_reg(cpu, 0, &raw_reg);
+			if (ret < 0)
+				return ret;
+
+			func(cpu, raw_reg.address_cells[0], info);
+		}
+		return 0;
+	}
+
 	dt_for_each_subnode(cpus, cpu) {
 
 		prop = fdt_get_property(fdt, cpu, "device_type", &len);
@@ -246,7 +471,7 @@ int dt_get_bootargs(const char **bootargs)
 	return 0;
 }
 
-int dt_get_default_console_node(void)
+static int __dt_get_default_console_node(void)
 {
 	const struct fdt_property *prop;
 	int node, len;
@@ -265,6 +490,28 @@ int dt_get_default_console_node(void)
 	return fdt_path_offset(fdt, prop->data);
 }
 
+int dt_get_default_console_node(void)
+{
+	if (dt_index.valid)
+		return dt_index.console;
+	return __dt_get_default_console_node();
+}
+
+int dt_get_node_by_phandle(u32 phandle)
+{
+	int n;
+
+	if (!dt_index.valid)
+		return fdt_node_offset_by_phandle(fdt, phandle);
+
+	n = dt_index.phandle_head[phandle % DT_INDEX_HASH_SIZE];
+	for (; n >= 0; n = dt_index.nodes[n].next_phandle)
+		if (dt_index.nodes[n].phandle == phandle)
+			return dt_index.nodes[n].fdtnode;
+
+	return -FDT_ERR_NOTFOUND;
+}
+
 int dt_init(const void *fdt_ptr)
 {
 	struct dt_bus *defbus = (struct dt_bus *)&dt_default_bus;
@@ -274,6 +521,7 @@ int dt_init(const void *fdt_ptr)
 	if (ret < 0)
 		return ret;
 	fdt = fdt_ptr;
+	dt_index.valid = false;
 
 	root = fdt_path_offset(fdt, "/");
 	if (root < 0)
@@ -287,5 +535,7 @@ int dt_init(const void *fdt_ptr)
 	defbus->nr_address_cells = root_nr_address_cells;
 	defbus->nr_size_cells = root_nr_size_cells;
 
+	dt_index_build();
+
 	return 0;
 }
@@ -17,7 +17,12 @@
  * devicetree init and libfdt helpers
  **********************************************************************/
 
-/* dt_init initializes devicetree with a pointer to an fdt, @fdt_ptr */
+/*
+ * dt_init initializes devicetree with a pointer to an fdt, @fdt_ptr,
+ * and indexes its nodes by compatible string, phandle and device_type,
+ * so that the lookups below don't rescan the fdt on each call. The fdt
+ * must not be modified after dt_init.
+ */
 extern int dt_init(const void *fdt_ptr);
 
 /* get the fdt pointer that devicetree is using */
@@ -223,6 +228,14 @@ extern int dt_get_bootargs(const char **bootargs);
  */
 extern int dt_get_default_console_node(void);
 
+/*
+ * dt_get_node_by_phandle gets the node whose phandle is @phandle
+ * returns
+ *  - the node (>= 0) on success
+ *  - a negative FDT_ERR_* value on failure
+ */
+extern int dt_get_node_by_phandle(u32 phandle);
+
 /*
  * dt_get_memory_params gets the memory parameters from the /memory node(s)
  * storing each memory region ("address size" tuple) in consecutive entries
@@ -0,0 +1,59 @@
+/*
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+#include "stats.h"
+
+/*
+ * Shell sort: no recursion, no allocation, and fast enough for the
+ * few thousand samples a benchmark run typically keeps.
+ */
+void stats_sort(u64 *samples, int nr)
+{
+	int gap, i, j;
+	u64 tmp;
+
+	for (gap = nr / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < nr; i++) {
+			tmp = samples[i];
+			for (j = i; j >= gap && samples[j - gap] > tmp; j -= gap)
+				samples[j] = samples[j - gap];
+			samples[j] = tmp;
+		}
+	}
+}
+
+u64 stats_percentile(const u64 *sorted, int nr, int pct)
+{
+	int idx;
+
+	if (!nr)
+		return 0;
+
+	idx = (nr * pct) / 100;
+	if (idx >= nr)
+		idx = nr - 1;
+	return sorted[idx];
+}
+
+void stats_report(const char *name, u64 *samples, int nr)
+{
+	u64 sum = 0;
+	int i;
+
+	if (!nr) {
+		printf("%s nr 0\n", name);
+		return;
+	}
+
+	stats_sort(samples, nr);
+	for (i = 0; i < nr; i++)
+		sum += samples[i];
+
+	printf("%s nr %d min %llu p50 %llu p90 %llu p99 %llu max %llu avg %llu\n",
+	       name, nr, samples[0],
+	       stats_percentile(samples, nr, 50),
+	       stats_percentile(samples, nr, 90),
+	       stats_percentile(samples, nr, 99),
+	       samples[nr - 1], sum / nr);
+}
@@ -0,0 +1,26 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+/*
+ * Helpers for benchmarks that collect per-iteration samples (usually
+ * TSC deltas) and want to report their distribution rather than just
+ * an average.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+
+extern void stats_sort(u64 *samples, int nr);
+
+/*
+ * stats_percentile returns the pct'th percentile of @nr samples that
+ * have already been sorted with stats_sort.
+ */
+extern u64 stats_percentile(const u64 *sorted, int nr, int pct);
+
+/*
+ * stats_report sorts @samples in place and prints one line of the form
+ *   <name> nr <n> min <x> p50 <x> p90 <x> p99 <x> max <x> avg <x>
+ */
+extern void stats_report(const char *name, u64 *samples, int nr);
+
+#endif
@@ -113,14 +113,31 @@ static void vm_device_init(struct virtio_mmio_device *vm_dev)
  * virtio-mmio device tree support
  ******************************************************/
 
-struct vm_dt_info {
-	u32 devid;
+/*
+ * Every virtio,mmio node is probed once, on the first bind, and its
+ * base and device id are remembered. Later binds then search that
+ * table rather than rescanning the device tree and rereading the
+ * magic and device id registers of each candidate.
+ */
+struct vm_dt_probe {
 	void *base;
+	u32 devid;
 };
 
-static int vm_dt_match(const struct dt_device *dev, int fdtnode)
+static struct vm_dt_probe *vm_dt_probes;
+static int nr_vm_dt_probes = -1;
+
+static int vm_dt_count(const struct dt_device *dev __unused,
+		       int fdtnode __unused)
+{
+	++nr_vm_dt_probes;
+	return false;
+}
+
+static int vm_dt_probe(const struct dt_device *dev, int fdtnode)
 {
-	struct vm_dt_info *info = (struct vm_dt_info *)dev->info;
+	int *n = (int *)dev->info;
+	struct vm_dt_probe *probe = &vm_dt_probes[(*n)++];
 	struct dt_pbus_reg base;
 	u32 magic;
 	int ret;
@@ -129,43 +146,61 @@ static int vm_dt_match(const struct dt_device *dev, int fdtnode)
 
 	ret = dt_pbus_get_base(dev, &base);
 	assert(ret == 0);
-	info->base = ioremap(base.addr, base.size);
+	probe->base = ioremap(base.addr, base.size);
 
-	magic = readl(info->base + VIRTIO_MMIO_MAGIC_VALUE);
+	magic = readl(probe->base + VIRTIO_MMIO_MAGIC_VALUE);
 	if (magic != ('v' | 'i' << 8 | 'r' << 16 | 't' << 24))
-		return false;
+		probe->devid = 0;
+	else
+		probe->devid = readl(probe->base + VIRTIO_MMIO_DEVICE_ID);
 
-	return readl(info->base + VIRTIO_MMIO_DEVICE_ID) == info->devid;
+	return false;
 }
 
-static struct virtio_device *virtio_mmio_dt_bind(u32 devid)
+static void vm_dt_probe_all(void)
 {
-	struct virtio_mmio_device *vm_dev;
 	struct dt_device dt_dev;
 	struct dt_bus dt_bus;
-	struct vm_dt_info info;
-	int node;
-
-	if (!dt_available())
-		return NULL;
+	int n = 0;
 
 	dt_bus_init_defaults(&dt_bus);
-	dt_bus.match = vm_dt_match;
+	dt_device_init(&dt_dev, &dt_bus, &n);
+
+	nr_vm_dt_probes = 0;
+	dt_bus.match = vm_dt_count;
+	dt_device_find_compatible(&dt_dev, "virtio,mmio");
+	if (!nr_vm_dt_probes)
+		return;
+
+	vm_dt_probes = calloc(nr_vm_dt_probes, sizeof(*vm_dt_probes));
+	assert(vm_dt_probes != NULL);
 
-	info.devid = devid;
+	dt_bus.match = vm_dt_probe;
+	dt_device_find_compatible(&dt_dev, "virtio,mmio");
+}
+
+static struct virtio_device *virtio_mmio_dt_bind(u32 devid)
+{
+	struct virtio_mmio_device *vm_dev;
+	int i;
+
+	if (!dt_available())
+		return NULL;
 
-	dt_device_init(&dt_dev, &dt_bus, &info);
+	if (nr_vm_dt_probes < 0)
+		vm_dt_probe_all();
 
-	node = dt_device_find_compatible(&dt_dev, "virtio,mmio");
-	assert(node >= 0 || node == -FDT_ERR_NOTFOUND);
+	for (i = 0; i < nr_vm_dt_probes; ++i)
+		if (vm_dt_probes[i].devid == devid)
+			break;
 
-	if (node == -FDT_ERR_NOTFOUND)
+	if (i == nr_vm_dt_probes)
 		return NULL;
 
 	vm_dev = calloc(1, sizeof(*vm_dev));
 	assert(vm_dev != NULL);
 
-	vm_dev->base = info.base;
+	vm_dev->base = vm_dt_probes[i].base;
 	vm_device_init(vm_dev);
 
 	return &vm_dev->vdev;
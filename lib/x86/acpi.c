@@ -1,5 +1,10 @@
 #include "libcflat.h"
 #include "acpi.h"
+#include "processor.h"
+#include "io.h"
+
+#define PM_TIMER_FREQUENCY	3579545
+#define PM_TIMER_MASK		0xffffff
 
 void* find_acpi_table_addr(u32 sig)
 {
@@ -50,3 +55,24 @@ void* find_acpi_table_addr(u32 sig)
     }
    return NULL;
 }
+
+u64 acpi_tsc_khz(void)
+{
+    struct fadt_descriptor_rev1 *fadt;
+    u64 t1, t2;
+    u32 start, ticks;
+
+    fadt = find_acpi_table_addr(FACP_SIGNATURE);
+    if (!fadt || !fadt->pm_tmr_blk)
+        return 0;
+
+    start = inl(fadt->pm_tmr_blk) & PM_TIMER_MASK;
+    t1 = rdtsc();
+    do {
+        ticks = ((inl(fadt->pm_tmr_blk) & PM_TIMER_MASK) - start)
+                & PM_TIMER_MASK;
+    } while (ticks < PM_TIMER_FREQUENCY / 100);
+    t2 = rdtsc();
+
+    return (t2 - t1) * PM_TIMER_FREQUENCY / (ticks * 1000ull);
+}
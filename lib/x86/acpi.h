@@ -101,4 +101,10 @@ struct facs_descriptor_rev1
 
 void* find_acpi_table_addr(u32 sig);
 
+/*
+ * Measures the TSC frequency against the ACPI PM timer, spinning for
+ * about 10ms.  Returns 0 if there is no PM timer.
+ */
+u64 acpi_tsc_khz(void);
+
 #endif
@@ -84,6 +84,7 @@ typedef struct  __attribute__((packed)) {
 #define BP_VECTOR   3
 #define UD_VECTOR   6
 #define GP_VECTOR   13
+#define PF_VECTOR   14
 
 #define KERNEL_CS 0x08
 #define KERNEL_DS 0x10
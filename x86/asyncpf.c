@@ -13,6 +13,13 @@
  * echo $$ >  /dev/cgroup/1/tasks
  * echo 512M > /dev/cgroup/1/memory.limit_in_bytes
  *
+ * With -append 'stress [MB]' every vCPU instead walks its own slice of
+ * MB (default 1024) megabytes of memory.  A PAGE_NOT_PRESENT fault on a
+ * page is not waited for: its token goes into a per-CPU table and the
+ * walk moves on to the next page, coming back once PAGE_READY arrives.
+ * The walk is timed with async PF disabled and enabled, and the report
+ * includes time-to-PAGE_READY, the number of pages touched while faults
+ * were outstanding and the peak number of outstanding faults.
  */
 #include "x86/msr.h"
 #include "x86/processor.h"
@@ -21,8 +28,11 @@
 #include "x86/desc.h"
 #include "x86/isr.h"
 #include "x86/vm.h"
+#include "x86/smp.h"
+#include "x86/atomic.h"
 
 #include "libcflat.h"
+#include "stats.h"
 #include <stdint.h>
 
 #define KVM_PV_REASON_PAGE_NOT_PRESENT 1
@@ -33,18 +43,37 @@
 #define KVM_ASYNC_PF_ENABLED                    (1 << 0)
 #define KVM_ASYNC_PF_SEND_ALWAYS                (1 << 1)
 
-volatile uint32_t apf_reason __attribute__((aligned(64)));
+#define MAX_CPUS 64
+
+struct apf_reason {
+	volatile uint32_t reason;
+} __attribute__((aligned(64)));
+
+static struct apf_reason apf_reason[MAX_CPUS];
 char *buf;
 volatile uint64_t  i;
 volatile uint64_t phys;
 
 static inline uint32_t get_apf_reason(void)
 {
-	uint32_t r = apf_reason;
-	apf_reason = 0;
+	struct apf_reason *apf = &apf_reason[smp_id()];
+	uint32_t r = apf->reason;
+	apf->reason = 0;
 	return r;
 }
 
+static void apf_enable(bool enable)
+{
+	struct apf_reason *apf = &apf_reason[smp_id()];
+
+	apf->reason = 0;
+	if (enable)
+		wrmsr(MSR_KVM_ASYNC_PF_EN, virt_to_phys((void *)apf) |
+		      KVM_ASYNC_PF_SEND_ALWAYS | KVM_ASYNC_PF_ENABLED);
+	else
+		wrmsr(MSR_KVM_ASYNC_PF_EN, 0);
+}
+
 static void pf_isr(struct ex_regs *r)
 {
 	void* virt = (void*)((ulong)(buf+i) & ~(PAGE_SIZE-1));
@@ -79,6 +108,266 @@ static void pf_isr(struct ex_regs *r)
 	}
 }
 
+#define MAX_OUTSTANDING 64
+/*
+ * A touch that waits in place for a free token queues one more ready
+ * page while all MAX_OUTSTANDING tokens can still complete before the
+ * next drain.
+ */
+#define READY_SLOTS (MAX_OUTSTANDING + 1)
+#define MAX_SAMPLES 512
+
+enum { PAGE_UNTOUCHED, PAGE_PENDING, PAGE_READY, PAGE_DONE };
+
+struct apf_token {
+	uint32_t token;
+	long page;	/* -1 if the fault was waited for in place */
+	uint64_t start;
+};
+
+struct apf_stress {
+	char *mem;
+	volatile uint8_t *state;
+	unsigned long npages;
+
+	struct apf_token tok[MAX_OUTSTANDING];
+	volatile int outstanding;
+	int max_outstanding;
+	volatile bool deferred;
+
+	/* pages whose PAGE_READY arrived, to be touched again */
+	volatile long ready[READY_SLOTS];
+	volatile unsigned ready_head, ready_tail;
+
+	uint64_t faults, overlap, cycles;
+	uint64_t lat[MAX_SAMPLES];
+	int nr_lat;
+};
+
+static struct apf_stress stress[MAX_CPUS];
+static int nr_cpus;
+static bool stress_apf;
+static ulong stress_cr3;
+static atomic_t nr_cpus_done;
+
+extern char apf_touch_insn, apf_touch_resume;
+
+/*
+ * The fault handler resumes a deferred access at apf_touch_resume and
+ * finds the address in rax, so keep this out of line and the labels
+ * unique.
+ */
+static __attribute__((noinline)) void apf_touch(char *p)
+{
+	asm volatile ("apf_touch_insn: movb $1, (%0)\n\t"
+		      "apf_touch_resume:" : : "a"(p) : "memory");
+}
+
+static struct apf_token *apf_token_alloc(struct apf_stress *st)
+{
+	int n;
+
+	for (n = 0; n < MAX_OUTSTANDING; n++)
+		if (!st->tok[n].start)
+			return &st->tok[n];
+	return NULL;
+}
+
+static void apf_token_ready(struct apf_stress *st, struct apf_token *tok,
+			    uint64_t now)
+{
+	if (st->nr_lat < MAX_SAMPLES)
+		st->lat[st->nr_lat++] = now - tok->start;
+	if (tok->page >= 0) {
+		assert(st->ready_tail - st->ready_head < READY_SLOTS);
+		st->state[tok->page] = PAGE_READY;
+		st->ready[st->ready_tail++ % READY_SLOTS] = tok->page;
+	}
+	tok->start = 0;
+	st->outstanding--;
+}
+
+static void stress_pf_isr(struct ex_regs *r)
+{
+	struct apf_stress *st = &stress[smp_id()];
+	uint32_t reason = get_apf_reason();
+	uint32_t token = read_cr2();
+	struct apf_token *tok;
+	uint64_t now = rdtsc();
+	int n;
+
+	switch (reason) {
+	case KVM_PV_REASON_PAGE_NOT_PRESENT:
+		st->faults++;
+		tok = apf_token_alloc(st);
+		if (!tok) {
+			/* Table full: nothing to do but wait in place. */
+			while (!apf_token_alloc(st)) {
+				safe_halt();
+				irq_disable();
+			}
+			tok = apf_token_alloc(st);
+		}
+		tok->token = token;
+		tok->start = now;
+		if (++st->outstanding > st->max_outstanding)
+			st->max_outstanding = st->outstanding;
+
+		if (r->rip == (ulong)&apf_touch_insn) {
+			tok->page = (r->rax - (ulong)st->mem) / PAGE_SIZE;
+			st->state[tok->page] = PAGE_PENDING;
+			st->deferred = true;
+			r->rip = (ulong)&apf_touch_resume;
+			break;
+		}
+
+		/* Not a walk access, e.g. the stack: block until ready. */
+		tok->page = -1;
+		while (tok->start) {
+			safe_halt();
+			irq_disable();
+		}
+		break;
+	case KVM_PV_REASON_PAGE_READY:
+		for (n = 0; n < MAX_OUTSTANDING; n++) {
+			tok = &st->tok[n];
+			if (tok->start && (token == ~0u || tok->token == token))
+				apf_token_ready(st, tok, now);
+		}
+		break;
+	default:
+		report("unexpected #PF at %lx addr %lx reason %d", false,
+		       r->rip, read_cr2(), reason);
+		exit(1);
+	}
+}
+
+static void stress_touch(struct apf_stress *st, unsigned long page)
+{
+	bool busy = st->outstanding;
+
+	st->deferred = false;
+	apf_touch(st->mem + page * PAGE_SIZE);
+	if (st->deferred)
+		return;
+	st->state[page] = PAGE_DONE;
+	if (busy)
+		st->overlap++;
+}
+
+static void stress_drain_ready(struct apf_stress *st)
+{
+	while (st->ready_head != st->ready_tail)
+		stress_touch(st, st->ready[st->ready_head++ % READY_SLOTS]);
+}
+
+static void stress_walk(void *data)
+{
+	struct apf_stress *st = &stress[smp_id()];
+	unsigned long page;
+	uint64_t t1;
+
+	write_cr3(stress_cr3);
+	apf_enable(stress_apf);
+	memset((void *)st->state, PAGE_UNTOUCHED, st->npages);
+	irq_enable();
+
+	t1 = rdtsc();
+	for (page = 0; page < st->npages; page++) {
+		stress_drain_ready(st);
+		if (st->state[page] == PAGE_UNTOUCHED)
+			stress_touch(st, page);
+	}
+	while (st->outstanding || st->ready_head != st->ready_tail) {
+		stress_drain_ready(st);
+		pause();
+	}
+	st->cycles = rdtsc() - t1;
+
+	irq_disable();
+	apf_enable(false);
+	atomic_inc(&nr_cpus_done);
+}
+
+static uint64_t stress_pass(const char *name, bool async)
+{
+	struct apf_stress *st;
+	uint64_t faults = 0, overlap = 0, cycles = 0, pages = 0;
+	int cpu, max_outstanding = 0;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		st = &stress[cpu];
+		st->faults = st->overlap = 0;
+		st->max_outstanding = 0;
+	}
+
+	stress_apf = async;
+	atomic_set(&nr_cpus_done, 0);
+	for (cpu = nr_cpus; cpu > 0; cpu--)
+		on_cpu_async(cpu - 1, stress_walk, NULL);
+	while (atomic_read(&nr_cpus_done) < nr_cpus)
+		pause();
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		st = &stress[cpu];
+		faults += st->faults;
+		overlap += st->overlap;
+		pages += st->npages;
+		if (st->cycles > cycles)
+			cycles = st->cycles;
+		if (st->max_outstanding > max_outstanding)
+			max_outstanding = st->max_outstanding;
+	}
+	printf("%s: %lld cycles/page, %lld async faults, "
+	       "%lld pages touched with faults pending, "
+	       "max %d outstanding per cpu\n", name, cycles / pages,
+	       faults, overlap, max_outstanding);
+	return cycles;
+}
+
+static void stress_test(unsigned long mb)
+{
+	unsigned long total = mb << 20, slice;
+	uint64_t sync_cycles, async_cycles;
+	char *mem;
+	uint8_t *state;
+	u64 *lat;
+	int cpu, nr_lat = 0;
+
+	nr_cpus = cpu_count() < MAX_CPUS ? cpu_count() : MAX_CPUS;
+	slice = (total / nr_cpus) & ~(PAGE_SIZE - 1);
+	printf("stress: %d cpus, %ld MB each\n", nr_cpus, slice >> 20);
+
+	handle_exception(14, stress_pf_isr);
+	stress_cr3 = read_cr3();
+	mem = vmalloc(slice * nr_cpus);
+	state = vmalloc(slice / PAGE_SIZE * nr_cpus);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		stress[cpu].mem = mem + cpu * slice;
+		stress[cpu].npages = slice / PAGE_SIZE;
+		stress[cpu].state = state + cpu * stress[cpu].npages;
+	}
+
+	/* The first pass faults everything in so that the host swaps. */
+	stress_pass("populate", true);
+	sync_cycles = stress_pass("async pf disabled", false);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		stress[cpu].nr_lat = 0;
+	async_cycles = stress_pass("async pf enabled", true);
+
+	printf("async/sync throughput: %lld%%\n",
+	       async_cycles ? sync_cycles * 100 / async_cycles : 0);
+
+	lat = vmalloc(sizeof(*lat) * MAX_SAMPLES * nr_cpus);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		memcpy(lat + nr_lat, stress[cpu].lat,
+		       stress[cpu].nr_lat * sizeof(*lat));
+		nr_lat += stress[cpu].nr_lat;
+	}
+	stats_report("time-to-PAGE_READY", lat, nr_lat);
+}
+
 #define MEM 1ull*1024*1024*1024
 
 int main(int ac, char **av)
@@ -86,13 +375,18 @@ int main(int ac, char **av)
 	int loop = 2;
 
 	setup_vm();
+	smp_init();
 	setup_idt();
+
+	if (ac > 1 && strcmp(av[1], "stress") == 0) {
+		stress_test(ac > 2 ? atol(av[2]) : MEM >> 20);
+		return report_summary();
+	}
+
 	printf("install handler\n");
 	handle_exception(14, pf_isr);
-	apf_reason = 0;
 	printf("enable async pf\n");
-	wrmsr(MSR_KVM_ASYNC_PF_EN, virt_to_phys((void*)&apf_reason) |
-			KVM_ASYNC_PF_SEND_ALWAYS | KVM_ASYNC_PF_ENABLED);
+	apf_enable(true);
 	printf("alloc memory\n");
 	buf = vmalloc(MEM);
 	irq_enable();
@@ -0,0 +1,315 @@
+/*
+ * Exception delivery latency
+ *
+ * Times, one delivery at a time, the guest-visible cost of taking an
+ * exception and returning from its handler: from just before the
+ * faulting or trapping instruction until the instruction after it.
+ * Every exception is delivered twice, through
+ *  - gate: the interrupt gate set up by setup_idt(), i.e. the usual
+ *          handle_exception() path;
+ *  - ist:  an IST stack on x86_64 (set_intr_alt_stack()),
+ *  - task: a task gate on i386 (set_intr_alt_stack() again).
+ *
+ * The exceptions, and whether KVM sees them:
+ *  ud        ud2; always intercepted and reinjected, since KVM emulates
+ *            some #UD instructions itself
+ *  bp        int3; only intercepted while the host debugs the guest
+ *  db-int1   int1 (icebp); #DB is always intercepted and reinjected
+ *  db-step   a single step trap after popf sets TF; likewise
+ *  gp        loading a bad selector; not intercepted
+ *  gp-rdmsr  rdmsr of an unknown MSR; exits on the rdmsr, after which
+ *            KVM injects the #GP (no #GP if KVM ignores unknown MSRs)
+ *  pf        a load from a not-present page; intercepted and reinjected
+ *            with shadow paging, delivered by the CPU with EPT/NPT
+ *  pf-fixup  like pf, but the handler maps the page and the load is
+ *            retried; the page is unmapped again before each sample
+ * Comparing the rows of a guest with EPT/NPT and one without, or with
+ * and without host debugging, shows what the intercepts cost.  "nop"
+ * is the overhead of the measurement itself, and "ud-setjmp" is #UD
+ * caught through test_for_exception().
+ *
+ * Usage: -append '[test...]' runs only the named tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "desc.h"
+#include "stats.h"
+
+#define NR_WARMUP 64
+#define NR_SAMPLES 4096
+
+#define X86_EFLAGS_TF	0x100
+
+/* Past the end of any GDT this test runs with. */
+#define BAD_SEL		0xfff8
+#define BAD_MSR		0xdeadbeef
+
+enum { PATH_GATE, PATH_ALT, NR_PATHS };
+
+#ifdef __x86_64__
+static const char *path_names[] = { "gate", "ist" };
+#else
+static const char *path_names[] = { "gate", "task" };
+#endif
+
+struct test {
+	const char *name;
+	int vector;		/* -1 for no exception */
+	bool error_code;
+	int skip;		/* bytes to skip after a fault, 0 for traps */
+	void (*trigger)(void);
+	void (*prepare)(void);	/* run untimed before each trigger */
+};
+
+static void *pf_page;
+static unsigned long *pf_pte;
+static unsigned long pf_phys;
+
+static struct test *cur_test;
+static volatile unsigned nr_delivered;
+static u64 samples[NR_SAMPLES];
+
+/* All of the faulting instructions below are two bytes long. */
+static void nop(void)
+{
+	asm volatile (".byte 0x66, 0x90");
+}
+
+static void ud(void)
+{
+	asm volatile ("ud2");
+}
+
+static void bp(void)
+{
+	asm volatile ("int3");
+}
+
+static void db_int1(void)
+{
+	asm volatile (".byte 0xf1");
+}
+
+static void db_step(void)
+{
+	asm volatile ("pushf"W"\n\t"
+		      "or"W" $" xstr(X86_EFLAGS_TF) ", (%%"R "sp)\n\t"
+		      "popf"W"\n\t"
+		      "nop" : : : "memory", "cc");
+}
+
+static void gp(void)
+{
+	asm volatile ("mov %0, %%es" : : "a"(BAD_SEL));
+}
+
+static void gp_rdmsr(void)
+{
+	asm volatile ("rdmsr" : : "c"(BAD_MSR) : "eax", "edx");
+}
+
+static void pf(void)
+{
+	u32 val;
+
+	asm volatile ("mov (%1), %0" : "=a"(val) : "b"(pf_page) : "memory");
+}
+
+static void pf_unmap(void)
+{
+	*pf_pte = 0;
+	invlpg(pf_page);
+}
+
+static struct test tests[] = {
+	{ "nop", -1, false, 0, nop, NULL },
+	{ "ud", UD_VECTOR, false, 2, ud, NULL },
+	{ "bp", BP_VECTOR, false, 0, bp, NULL },
+	{ "db-int1", DB_VECTOR, false, 0, db_int1, NULL },
+	{ "db-step", DB_VECTOR, false, 0, db_step, NULL },
+	{ "gp", GP_VECTOR, true, 2, gp, NULL },
+	{ "gp-rdmsr", GP_VECTOR, true, 2, gp_rdmsr, NULL },
+	{ "pf", PF_VECTOR, true, 2, pf, pf_unmap },
+	{ "pf-fixup", PF_VECTOR, true, 0, pf, pf_unmap },
+};
+
+/* Returns where the interrupted code resumes. */
+static ulong fixup(ulong ip, ulong *flags)
+{
+	nr_delivered++;
+	*flags &= ~X86_EFLAGS_TF;
+	if (cur_test->trigger == pf && !cur_test->skip)
+		*pf_pte = pf_phys | PTE_PRESENT | PTE_WRITE;
+	return ip + cur_test->skip;
+}
+
+static void gate_handler(struct ex_regs *regs)
+{
+	regs->rip = fixup(regs->rip, &regs->rflags);
+}
+
+/*
+ * On x86_64 @frame is the IST stack's interrupt frame; on i386 the
+ * interrupted state is in the main TSS instead.
+ */
+void do_alt_exception(ulong *frame)
+{
+#ifdef __x86_64__
+	frame[0] = fixup(frame[0], &frame[2]);
+#else
+	ulong flags = tss.eflags;
+
+	tss.eip = fixup(tss.eip, &flags);
+	tss.eflags = flags;
+#endif
+}
+
+extern char alt_entry, alt_entry_err;
+
+asm ("alt_entry:\n\t"
+#ifdef __x86_64__
+     "push %rax; push %rcx; push %rdx; push %rsi; push %rdi\n\t"
+     "push %r8; push %r9; push %r10; push %r11\n\t"
+     "lea 9*8(%rsp), %rdi\n\t"
+     "call do_alt_exception\n\t"
+     "pop %r11; pop %r10; pop %r9; pop %r8\n\t"
+     "pop %rdi; pop %rsi; pop %rdx; pop %rcx; pop %rax\n\t"
+     "iretq\n\t"
+#else
+     "push $0\n\t"
+     "call do_alt_exception\n\t"
+     "add $4, %esp\n\t"
+     "iret\n\t"
+     "jmp alt_entry\n\t"
+#endif
+     "alt_entry_err:\n\t"
+#ifdef __x86_64__
+     /* the error code leaves the stack misaligned, hence the padding */
+     "push %rax; push %rcx; push %rdx; push %rsi; push %rdi\n\t"
+     "push %r8; push %r9; push %r10; push %r11\n\t"
+     "sub $8, %rsp\n\t"
+     "lea 11*8(%rsp), %rdi\n\t"
+     "call do_alt_exception\n\t"
+     "add $8, %rsp\n\t"
+     "pop %r11; pop %r10; pop %r9; pop %r8\n\t"
+     "pop %rdi; pop %rsi; pop %rdx; pop %rcx; pop %rax\n\t"
+     "add $8, %rsp\n\t"
+     "iretq\n\t"
+#else
+     "push $0\n\t"
+     "call do_alt_exception\n\t"
+     "add $8, %esp\n\t"	/* and the error code */
+     "iret\n\t"
+     "jmp alt_entry_err\n\t"
+#endif
+    );
+
+static void run_test(struct test *t, int path)
+{
+	char name[64];
+	u64 t1;
+	int i;
+
+	cur_test = t;
+	if (t->vector >= 0) {
+		if (path == PATH_GATE)
+			handle_exception(t->vector, gate_handler);
+		else
+			set_intr_alt_stack(t->vector, t->error_code ?
+					   &alt_entry_err : &alt_entry);
+	}
+
+	nr_delivered = 0;
+	for (i = 0; i < NR_WARMUP; i++) {
+		if (t->prepare)
+			t->prepare();
+		t->trigger();
+	}
+	if (t->vector >= 0 && nr_delivered != NR_WARMUP) {
+		printf("%s %s (skipped, %d of %d delivered)\n", t->name,
+		       path_names[path], nr_delivered, NR_WARMUP);
+		return;
+	}
+
+	for (i = 0; i < NR_SAMPLES; i++) {
+		if (t->prepare)
+			t->prepare();
+		t1 = rdtsc();
+		t->trigger();
+		samples[i] = rdtsc() - t1;
+	}
+
+	snprintf(name, sizeof(name), "%s %s", t->name, path_names[path]);
+	stats_report(name, samples, NR_SAMPLES);
+	if (t->vector >= 0)
+		report("%s", nr_delivered == NR_WARMUP + NR_SAMPLES, name);
+}
+
+static void ud_setjmp_trigger(void *data)
+{
+	ud();
+}
+
+static void run_setjmp_test(void)
+{
+	int i, nr = 0;
+	u64 t1;
+
+	for (i = 0; i < NR_WARMUP; i++)
+		test_for_exception(UD_VECTOR, ud_setjmp_trigger, NULL);
+
+	for (i = 0; i < NR_SAMPLES; i++) {
+		t1 = rdtsc();
+		nr += test_for_exception(UD_VECTOR, ud_setjmp_trigger, NULL);
+		samples[i] = rdtsc() - t1;
+	}
+
+	stats_report("ud-setjmp gate", samples, NR_SAMPLES);
+	report("ud-setjmp gate", nr == NR_SAMPLES);
+}
+
+static bool test_wanted(const char *name, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int ac, char **av)
+{
+	int i, path;
+
+	setup_vm();
+	setup_idt();
+	setup_alt_stack();
+
+	pf_page = alloc_vpage();
+	pf_phys = virt_to_phys(alloc_page());
+	pf_pte = install_pte(phys_to_virt(read_cr3()), 1, pf_page, 0, 0);
+
+	/*
+	 * The gate rows go first: set_intr_alt_stack() replaces the IDT
+	 * entries that handle_exception() relies on.
+	 */
+	for (path = 0; path < NR_PATHS; path++) {
+		for (i = 0; i < ARRAY_SIZE(tests); i++)
+			if (test_wanted(tests[i].name, av + 1, ac - 1) &&
+			    (tests[i].vector >= 0 || path == PATH_GATE))
+				run_test(&tests[i], path);
+
+		if (path == PATH_GATE && test_wanted("ud-setjmp", av + 1, ac - 1))
+			run_setjmp_test();
+	}
+
+	return report_summary();
+}
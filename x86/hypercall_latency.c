@@ -0,0 +1,295 @@
+/*
+ * Hypercall round-trip latency
+ *
+ * Times individual KVM PV hypercalls and Hyper-V hypercalls (fast,
+ * register based, and slow, with a memory input page) on 1..N vCPUs
+ * running concurrently, and prints the distribution of cycles per call.
+ *
+ * Usage: -append '[test...]', e.g. -append 'hv_post_message kvm_send_ipi'
+ * runs only the named tests; without arguments every supported test runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "desc.h"
+#include "isr.h"
+#include "apic.h"
+#include "smp.h"
+#include "atomic.h"
+#include "stats.h"
+#include "hyperv.h"
+
+#define MAX_CPUS 64
+#define NR_WARMUP 64
+#define NR_SAMPLES 1024
+
+#define KVM_HC_VAPIC_POLL_IRQ	1
+#define KVM_HC_KICK_CPU		5
+#define KVM_HC_SEND_IPI		10
+
+#define KVM_FEATURE_PV_UNHALT	7
+#define KVM_FEATURE_PV_SEND_IPI	11
+
+#define IPI_VECTOR 0xee
+
+struct test {
+	const char *name;
+	bool (*valid)(void);
+	u64 (*func)(int cpu, int nr_cpus);
+};
+
+static int nr_cpus;
+static bool is_amd;
+static u32 kvm_features;
+static u64 samples[MAX_CPUS * NR_SAMPLES];
+static atomic_t nr_cpus_done;
+static atomic_t nr_ipis;
+static struct hv_input_post_message *hv_input_page;
+static void *hv_output_page;
+
+static inline long kvm_hypercall2(unsigned nr, unsigned long p1,
+				  unsigned long p2)
+{
+	long ret;
+
+	if (is_amd)
+		asm volatile ("vmmcall" : "=a"(ret)
+			      : "a"(nr), "b"(p1), "c"(p2) : "memory");
+	else
+		asm volatile ("vmcall" : "=a"(ret)
+			      : "a"(nr), "b"(p1), "c"(p2) : "memory");
+	return ret;
+}
+
+static inline long kvm_hypercall4(unsigned nr, unsigned long p1,
+				  unsigned long p2, unsigned long p3,
+				  unsigned long p4)
+{
+	long ret;
+
+	if (is_amd)
+		asm volatile ("vmmcall" : "=a"(ret)
+			      : "a"(nr), "b"(p1), "c"(p2), "d"(p3), "S"(p4)
+			      : "memory");
+	else
+		asm volatile ("vmcall" : "=a"(ret)
+			      : "a"(nr), "b"(p1), "c"(p2), "d"(p3), "S"(p4)
+			      : "memory");
+	return ret;
+}
+
+/*
+ * With Hyper-V enlightenments enabled the KVM leaves move up, so scan
+ * for the signature instead of assuming 0x40000000.
+ */
+static u32 kvm_cpuid_base(void)
+{
+	struct cpuid c;
+	u32 base;
+
+	for (base = 0x40000000; base < 0x40010000; base += 0x100) {
+		c = cpuid(base);
+		if (c.b == 0x4b4d564b && c.c == 0x564b4d56 && c.d == 0x4d)
+			return base;
+	}
+	return 0;
+}
+
+static bool kvm_has_feature(int bit)
+{
+	return kvm_features & (1u << bit);
+}
+
+static u64 kvm_vapic_poll_irq(int cpu, int nr_cpus)
+{
+	return kvm_hypercall2(KVM_HC_VAPIC_POLL_IRQ, 0, 0);
+}
+
+static bool kick_cpu_valid(void)
+{
+	return kvm_has_feature(KVM_FEATURE_PV_UNHALT);
+}
+
+/* Kick the next CPU in the set so that the wakeup path crosses vCPUs. */
+static u64 kvm_kick_cpu(int cpu, int nr_cpus)
+{
+	return kvm_hypercall2(KVM_HC_KICK_CPU, 0, (cpu + 1) % nr_cpus);
+}
+
+static bool send_ipi_valid(void)
+{
+	return kvm_has_feature(KVM_FEATURE_PV_SEND_IPI);
+}
+
+static void ipi_isr(isr_regs_t *regs)
+{
+	atomic_inc(&nr_ipis);
+	eoi();
+}
+
+/*
+ * IPI ourselves with interrupts disabled: the vector stays pending in
+ * IRR and is taken once when the measurement loop is over.
+ */
+static u64 kvm_send_ipi(int cpu, int nr_cpus)
+{
+	unsigned long apicid = apic_id();
+
+	return kvm_hypercall4(KVM_HC_SEND_IPI, 1, 0, apicid,
+			      APIC_DM_FIXED | IPI_VECTOR);
+}
+
+static bool hv_valid(void)
+{
+	return hv_input_page != NULL;
+}
+
+static u64 hv_invalid_code(int cpu, int nr_cpus)
+{
+	return hv_hypercall(HV_HYPERCALL_FAST_BIT | 0xfff, 0, 0);
+}
+
+static u64 hv_long_spin_wait(int cpu, int nr_cpus)
+{
+	return hv_hypercall(HV_HYPERCALL_FAST_BIT |
+			    HVCALL_NOTIFY_LONG_SPIN_WAIT, 0, 0);
+}
+
+static u64 hv_signal_event_fast(int cpu, int nr_cpus)
+{
+	return hv_hypercall(HV_HYPERCALL_FAST_BIT | HVCALL_SIGNAL_EVENT,
+			    0, 0);
+}
+
+/* Slow hypercall: the parameters are read from the input page. */
+static u64 hv_post_message(int cpu, int nr_cpus)
+{
+	return hv_hypercall(HVCALL_POST_MESSAGE,
+			    virt_to_phys(hv_input_page),
+			    virt_to_phys(hv_output_page));
+}
+
+static struct test tests[] = {
+	{ "kvm_vapic_poll_irq", NULL, kvm_vapic_poll_irq },
+	{ "kvm_kick_cpu", kick_cpu_valid, kvm_kick_cpu },
+	{ "kvm_send_ipi", send_ipi_valid, kvm_send_ipi },
+	{ "hv_invalid_code", hv_valid, hv_invalid_code },
+	{ "hv_long_spin_wait", hv_valid, hv_long_spin_wait },
+	{ "hv_signal_event_fast", hv_valid, hv_signal_event_fast },
+	{ "hv_post_message", hv_valid, hv_post_message },
+};
+
+static struct test *cur_test;
+static int cur_nr_cpus;
+static u64 cur_status;
+
+static void run_test(void *data)
+{
+	int cpu = smp_id();
+	u64 *s = &samples[cpu * NR_SAMPLES];
+	u64 (*func)(int, int) = cur_test->func;
+	u64 t1, status = 0;
+	int i;
+
+	for (i = 0; i < NR_WARMUP; i++)
+		status = func(cpu, cur_nr_cpus);
+	if (cpu == 0)
+		cur_status = status;
+
+	for (i = 0; i < NR_SAMPLES; i++) {
+		t1 = rdtsc();
+		func(cpu, cur_nr_cpus);
+		s[i] = rdtsc() - t1;
+	}
+
+	/* Take any interrupt left pending by the test. */
+	asm volatile ("sti; nop; cli");
+	atomic_inc(&nr_cpus_done);
+}
+
+static void do_test(struct test *test)
+{
+	char name[64];
+	int nr, i;
+
+	if (test->valid && !test->valid()) {
+		printf("%s (skipped)\n", test->name);
+		return;
+	}
+
+	cur_test = test;
+	for (nr = 1; ; nr = nr * 2 < nr_cpus ? nr * 2 : nr_cpus) {
+		cur_nr_cpus = nr;
+		atomic_set(&nr_cpus_done, 0);
+		for (i = nr; i > 0; i--)
+			on_cpu_async(i - 1, run_test, NULL);
+		while (atomic_read(&nr_cpus_done) < nr)
+			pause();
+
+		snprintf(name, sizeof(name), "%s cpus %d status 0x%x",
+			 test->name, nr, (u32)cur_status);
+		stats_report(name, samples, nr * NR_SAMPLES);
+
+		if (nr == nr_cpus)
+			break;
+	}
+}
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], test->name) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int ac, char **av)
+{
+	u32 base;
+	int i;
+
+	setup_vm();
+	smp_init();
+	setup_idt();
+	mask_pic_interrupts();
+
+	nr_cpus = cpu_count();
+	if (nr_cpus > MAX_CPUS)
+		nr_cpus = MAX_CPUS;
+	printf("ncpus = %d\n", nr_cpus);
+
+	is_amd = cpuid(0).b == 0x68747541;	/* "Auth" */
+	base = kvm_cpuid_base();
+	if (base)
+		kvm_features = cpuid(base + 1).a;
+	printf("kvm cpuid base 0x%x features 0x%x\n", base, kvm_features);
+
+	handle_irq(IPI_VECTOR, ipi_isr);
+
+	if (hv_hypercall_supported()) {
+		hv_hypercall_enable(alloc_page());
+		hv_input_page = alloc_page();
+		hv_output_page = alloc_page();
+		memset(hv_input_page, 0, PAGE_SIZE);
+		hv_input_page->connectionid = 1;
+		hv_input_page->message_type = 1;
+		hv_input_page->payload_size = 8;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], av + 1, ac - 1))
+			do_test(&tests[i]);
+
+	if (hv_input_page)
+		hv_hypercall_disable();
+
+	return report_summary();
+}
@@ -1,4 +1,5 @@
 #include "hyperv.h"
+#include "vm.h"
 
 static void synic_ctl(u8 ctl, u8 vcpu_id, u8 sint)
 {
@@ -22,3 +23,51 @@ void synic_sint_destroy(int vcpu, int sint)
     wrmsr(HV_X64_MSR_SINT0 + sint, 0xFF|HV_SYNIC_SINT_MASKED);
     synic_ctl(HV_TEST_DEV_SINT_ROUTE_DESTROY, vcpu, sint);
 }
+
+static void *hv_hypercall_page;
+
+void hv_hypercall_enable(void *page)
+{
+    /* Any non-zero guest OS id unlocks the hypercall MSR. */
+    wrmsr(HV_X64_MSR_GUEST_OS_ID, 1);
+    wrmsr(HV_X64_MSR_HYPERCALL,
+          (u64)virt_to_phys(page) | HV_X64_MSR_HYPERCALL_ENABLE);
+    hv_hypercall_page = page;
+}
+
+void hv_hypercall_disable(void)
+{
+    wrmsr(HV_X64_MSR_HYPERCALL, 0);
+    wrmsr(HV_X64_MSR_GUEST_OS_ID, 0);
+    hv_hypercall_page = NULL;
+}
+
+/*
+ * Call through the hypercall page, which the hypervisor fills with the
+ * right VMCALL/VMMCALL sequence.  For fast hypercalls @input and @output
+ * are the register parameters rather than guest physical addresses.
+ */
+u64 hv_hypercall(u64 control, u64 input, u64 output)
+{
+    u64 status;
+
+#ifdef __x86_64__
+    register u64 r8 asm("r8") = output;
+
+    asm volatile ("call *%[page]"
+                  : "=a"(status), "+c"(control), "+d"(input), "+r"(r8)
+                  : [page] "m"(hv_hypercall_page)
+                  : "r9", "r10", "r11", "memory", "cc");
+#else
+    u32 in_lo = input, in_hi = input >> 32;
+    u32 out_lo = output, out_hi = output >> 32;
+
+    asm volatile ("call *%[page]"
+                  : "+A"(control), "+b"(in_hi), "+c"(in_lo),
+                    "+D"(out_hi), "+S"(out_lo)
+                  : [page] "m"(hv_hypercall_page)
+                  : "memory", "cc");
+    status = control;
+#endif
+    return status;
+}
@@ -10,6 +10,11 @@
 #define HV_X64_MSR_TIME_REF_COUNT_AVAILABLE     (1 << 1)
 #define HV_X64_MSR_SYNIC_AVAILABLE              (1 << 2)
 #define HV_X64_MSR_SYNTIMER_AVAILABLE           (1 << 3)
+#define HV_X64_MSR_HYPERCALL_AVAILABLE          (1 << 5)
+
+#define HV_X64_MSR_GUEST_OS_ID                  0x40000000
+#define HV_X64_MSR_HYPERCALL                    0x40000001
+#define HV_X64_MSR_HYPERCALL_ENABLE             (1ULL << 0)
 
 #define HV_X64_MSR_TIME_REF_COUNT               0x40000020
 
@@ -155,6 +160,26 @@ struct hv_message_page {
         struct hv_message sint_message[HV_SYNIC_SINT_COUNT];
 };
 
+/* Declare the various hypercall operations. */
+#define HVCALL_NOTIFY_LONG_SPIN_WAIT    0x0008
+#define HVCALL_POST_MESSAGE             0x005c
+#define HVCALL_SIGNAL_EVENT             0x005d
+
+#define HV_HYPERCALL_FAST_BIT           (1ULL << 16)
+#define HV_HYPERCALL_RESULT_MASK        0xffff
+
+#define HV_STATUS_SUCCESS               0
+#define HV_STATUS_INVALID_HYPERCALL_CODE 2
+
+/* Input page layout of HVCALL_POST_MESSAGE. */
+struct hv_input_post_message {
+        uint32_t connectionid;
+        uint32_t reserved;
+        uint32_t message_type;
+        uint32_t payload_size;
+        uint64_t payload[HV_MESSAGE_PAYLOAD_QWORD_COUNT];
+};
+
 enum {
     HV_TEST_DEV_SINT_ROUTE_CREATE = 1,
     HV_TEST_DEV_SINT_ROUTE_DESTROY,
@@ -176,8 +201,17 @@ static inline bool hv_time_ref_counter_supported(void)
     return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_TIME_REF_COUNT_AVAILABLE;
 }
 
+static inline bool hv_hypercall_supported(void)
+{
+    return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_HYPERCALL_AVAILABLE;
+}
+
 void synic_sint_create(int vcpu, int sint, int vec, bool auto_eoi);
 void synic_sint_set(int vcpu, int sint);
 void synic_sint_destroy(int vcpu, int sint);
 
+void hv_hypercall_enable(void *page);
+void hv_hypercall_disable(void);
+u64 hv_hypercall(u64 control, u64 input, u64 output);
+
 #endif
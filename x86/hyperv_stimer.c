@@ -8,9 +8,10 @@
 #include "io.h"
 #include "smp.h"
 #include "atomic.h"
+#include "stats.h"
 #include "hyperv.h"
 
-#define MAX_CPUS 4
+#define MAX_CPUS 64
 
 #define SINT1_VEC 0xF1
 #define SINT2_VEC 0xF2
@@ -19,14 +20,28 @@
 #define SINT2_NUM 3
 #define ONE_MS_IN_100NS 10000
 
+/*
+ * Scale mode (-append scale): all four timers of every vCPU run
+ * periodically at SCALE_PERIOD, for 1, 2, 4, ... vCPUs at once.
+ */
+#define SCALE_PERIOD_100NS 1000
+#define SCALE_FIRES 512
+#define SCALE_SAMPLES (SCALE_FIRES * HV_SYNIC_STIMER_COUNT)
+
 static atomic_t g_cpus_comp_count;
 static int g_cpus_count;
 static struct spinlock g_synic_alloc_lock;
+static bool g_scale;
 
 struct stimer {
     int sint;
     int index;
     atomic_t fire_count;
+    /* scale mode, in reference counter units */
+    u64 period;
+    u64 first_exp;
+    u64 last_exp;
+    u64 missed;
 };
 
 struct svcpu {
@@ -34,10 +49,17 @@ struct svcpu {
     void *msg_page;
     void *evt_page;
     struct stimer timer[HV_SYNIC_STIMER_COUNT];
+    int nr_lateness;
 };
 
 static struct svcpu g_synic_vcpu[MAX_CPUS];
 
+/*
+ * Per-vCPU expiration lateness, contiguous so that vCPUs 0..n-1 can be
+ * reported together.
+ */
+static u64 g_lateness[MAX_CPUS][SCALE_SAMPLES];
+
 static void *synic_alloc_page(void)
 {
     void *page;
@@ -82,9 +104,36 @@ static void stimer_shutdown(struct stimer *timer)
     wrmsr(HV_X64_MSR_STIMER0_CONFIG + 2*timer->index, 0);
 }
 
+/*
+ * Expirations that arrive more than half a period after the previous
+ * one plus a period count as missed periods.
+ */
+static void stimer_scale_record(struct svcpu *svcpu, struct stimer *timer,
+                                u64 expiration_time, u64 delivery_time)
+{
+    u64 k;
+
+    g_lateness[svcpu->vcpu][svcpu->nr_lateness++] =
+        delivery_time > expiration_time ? delivery_time - expiration_time : 0;
+
+    if (atomic_read(&timer->fire_count) == 0) {
+        timer->first_exp = expiration_time;
+    } else {
+        k = (expiration_time - timer->last_exp + timer->period / 2) /
+            timer->period;
+        if (k > 1) {
+            timer->missed += k - 1;
+        }
+    }
+    timer->last_exp = expiration_time;
+}
+
 static void process_stimer_expired(struct svcpu *svcpu, struct stimer *timer,
                                    u64 expiration_time, u64 delivery_time)
 {
+    if (g_scale && atomic_read(&timer->fire_count) < SCALE_FIRES) {
+        stimer_scale_record(svcpu, timer, expiration_time, delivery_time);
+    }
     atomic_inc(&timer->fire_count);
 }
 
@@ -314,20 +363,109 @@ static void stimer_test_cleanup(void *ctx)
     cpu_comp();
 }
 
-static void on_each_cpu_async_wait(void (*func)(void *ctx), void *ctx)
+static void on_cpus_async_wait(int ncpus, void (*func)(void *ctx), void *ctx)
 {
     int i;
 
     atomic_set(&g_cpus_comp_count, 0);
-    for (i = 0; i < g_cpus_count; i++) {
+    /* The calling CPU runs func synchronously, so start it last. */
+    for (i = ncpus - 1; i >= 0; i--) {
         on_cpu_async(i, func, ctx);
     }
-    while (atomic_read(&g_cpus_comp_count) != g_cpus_count) {
+    while (atomic_read(&g_cpus_comp_count) != ncpus) {
         pause();
     }
 }
 
-static void stimer_test_all(void)
+static void on_each_cpu_async_wait(void (*func)(void *ctx), void *ctx)
+{
+    on_cpus_async_wait(g_cpus_count, func, ctx);
+}
+
+static void stimer_scale(void *ctx)
+{
+    int vcpu = smp_id(), i;
+    struct svcpu *svcpu = &g_synic_vcpu[vcpu];
+    struct stimer *timer;
+
+    svcpu->nr_lateness = 0;
+    irq_enable();
+
+    for (i = 0; i < ARRAY_SIZE(svcpu->timer); i++) {
+        timer = &svcpu->timer[i];
+        stimer_init(timer, i);
+        timer->period = SCALE_PERIOD_100NS;
+        stimer_start(timer, false, true, SCALE_PERIOD_100NS,
+                     (i & 1) ? SINT2_NUM : SINT1_NUM);
+    }
+    for (i = 0; i < ARRAY_SIZE(svcpu->timer); i++) {
+        while (atomic_read(&svcpu->timer[i].fire_count) < SCALE_FIRES) {
+            pause();
+        }
+    }
+    stimers_shutdown();
+
+    irq_disable();
+    cpu_comp();
+}
+
+/*
+ * Drift is how far the last expiration of a timer is from where
+ * SCALE_FIRES periods (plus the missed ones) after the first would put
+ * it; lateness is the host's delivery time minus the expiration time.
+ */
+static void stimer_scale_report(int ncpus)
+{
+    s64 drift, max_drift = 0;
+    u64 missed = 0;
+    struct stimer *timer;
+    char name[64];
+    int vcpu, i;
+
+    for (vcpu = 0; vcpu < ncpus; vcpu++) {
+        for (i = 0; i < HV_SYNIC_STIMER_COUNT; i++) {
+            timer = &g_synic_vcpu[vcpu].timer[i];
+            missed += timer->missed;
+            drift = (timer->last_exp - timer->first_exp) -
+                    (SCALE_FIRES - 1 + timer->missed) * timer->period;
+            if (drift < 0) {
+                drift = -drift;
+            }
+            if (drift > max_drift) {
+                max_drift = drift;
+            }
+        }
+    }
+
+    printf("scale cpus %d timers %d period %d us: missed periods %llu, "
+           "max drift %lld us\n", ncpus, ncpus * HV_SYNIC_STIMER_COUNT,
+           SCALE_PERIOD_100NS / 10, missed, max_drift / 10);
+
+    for (vcpu = 0; vcpu < ncpus; vcpu++) {
+        for (i = 0; i < SCALE_SAMPLES; i++) {
+            g_lateness[vcpu][i] *= 100;
+        }
+    }
+    snprintf(name, sizeof(name), "scale cpus %d lateness ns", ncpus);
+    stats_report(name, &g_lateness[0][0], ncpus * SCALE_SAMPLES);
+}
+
+static void stimer_test_scale(void)
+{
+    int nr;
+
+    g_scale = true;
+    for (nr = 1; ; nr = nr * 2 < g_cpus_count ? nr * 2 : g_cpus_count) {
+        on_cpus_async_wait(nr, stimer_scale, NULL);
+        stimer_scale_report(nr);
+        if (nr == g_cpus_count) {
+            break;
+        }
+    }
+    g_scale = false;
+}
+
+static void stimer_test_all(bool scale)
 {
     int ncpus;
 
@@ -348,7 +486,11 @@ static void stimer_test_all(void)
     g_cpus_count = ncpus;
 
     on_each_cpu_async_wait(stimer_test_prepare, (void *)read_cr3());
-    on_each_cpu_async_wait(stimer_test, NULL);
+    if (scale) {
+        stimer_test_scale();
+    } else {
+        on_each_cpu_async_wait(stimer_test, NULL);
+    }
     on_each_cpu_async_wait(stimer_test_cleanup, NULL);
 }
 
@@ -370,7 +512,7 @@ int main(int ac, char **av)
         goto done;
     }
 
-    stimer_test_all();
+    stimer_test_all(ac > 1 && strcmp(av[1], "scale") == 0);
 done:
     return report_summary();
 }
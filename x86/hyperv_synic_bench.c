@@ -0,0 +1,432 @@
+/*
+ * Hyper-V SynIC message and event delivery cost
+ *
+ * Events are SINTs raised through hyperv-testdev's SINT routes (an
+ * irqfd in the host), messages are synthetic timer expirations that the
+ * host posts into the SIMP slot of their SINT.  Even SINTs EOI through
+ * the local APIC, odd ones are auto-EOI.
+ *
+ * event_latency:   post-to-ISR cycles to each vCPU, per EOI mode
+ * message_latency: timer-arm-to-ISR cycles on each vCPU, per EOI mode
+ * event_flood:     every vCPU raises all 16 SINTs on its neighbour
+ * message_flood:   all four timers of every vCPU expire on one SINT at
+ *                  once, so messages queue behind a busy slot and each
+ *                  one is released by an EOM write
+ *
+ * Usage: -append '[test...]'; without arguments every test runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "msr.h"
+#include "isr.h"
+#include "vm.h"
+#include "apic.h"
+#include "desc.h"
+#include "io.h"
+#include "smp.h"
+#include "atomic.h"
+#include "stats.h"
+#include "hyperv.h"
+
+#define MAX_CPUS 64
+#define NR_WARMUP 16
+#define NR_SAMPLES 1024
+#define NR_ROUNDS 4096
+
+#define SINT_VEC_BASE 0xB0
+#define SINT_EOI 2
+#define SINT_AUTO_EOI 3
+
+struct bench_vcpu {
+    struct hv_message_page *msg_page;
+    void *evt_page;
+    atomic_t isr_count;
+    atomic_t msg_count;
+    volatile u64 isr_tsc;
+    volatile u64 eoi_cycles;
+    u64 nr_eom;
+    u64 eom_cycles;
+} __attribute__((aligned(64)));
+
+struct test {
+    const char *name;
+    void (*func)(void);
+};
+
+static int ncpus;
+static bool has_ref_count;
+static struct bench_vcpu vcpus[MAX_CPUS];
+static atomic_t cpus_comp_count;
+static u64 lat[NR_SAMPLES];
+static u64 eoi_cost[NR_SAMPLES];
+
+static const char *sint_mode(int sint)
+{
+    return (sint & 1) ? "auto_eoi" : "eoi";
+}
+
+static void process_msgs(struct bench_vcpu *bv)
+{
+    struct hv_message *msg;
+    u64 t;
+    int i;
+
+    for (i = 0; i < HV_SYNIC_SINT_COUNT; i++) {
+        msg = &bv->msg_page->sint_message[i];
+        if (msg->header.message_type == HVMSG_NONE) {
+            continue;
+        }
+        msg->header.message_type = HVMSG_NONE;
+        mb();
+        atomic_inc(&bv->msg_count);
+        if (msg->header.message_flags.msg_pending) {
+            t = rdtsc();
+            wrmsr(HV_X64_MSR_EOM, 0);
+            bv->eom_cycles += rdtsc() - t;
+            bv->nr_eom++;
+        }
+    }
+}
+
+static void synic_isr(isr_regs_t *regs)
+{
+    struct bench_vcpu *bv = &vcpus[smp_id()];
+    u64 t = rdtsc();
+
+    bv->isr_tsc = t;
+    process_msgs(bv);
+    t = rdtsc();
+    eoi();
+    bv->eoi_cycles = rdtsc() - t;
+    atomic_inc(&bv->isr_count);
+}
+
+static void synic_auto_eoi_isr(isr_regs_t *regs)
+{
+    struct bench_vcpu *bv = &vcpus[smp_id()];
+
+    bv->isr_tsc = rdtsc();
+    process_msgs(bv);
+    bv->eoi_cycles = 0;
+    atomic_inc(&bv->isr_count);
+}
+
+static void synic_bench_prepare(void *ctx)
+{
+    int vcpu = smp_id(), i;
+    struct bench_vcpu *bv = &vcpus[vcpu];
+
+    write_cr3((ulong)ctx);
+
+    wrmsr(HV_X64_MSR_SIMP, (u64)virt_to_phys(bv->msg_page) |
+            HV_SYNIC_SIMP_ENABLE);
+    wrmsr(HV_X64_MSR_SIEFP, (u64)virt_to_phys(bv->evt_page) |
+            HV_SYNIC_SIEFP_ENABLE);
+    wrmsr(HV_X64_MSR_SCONTROL, HV_SYNIC_CONTROL_ENABLE);
+    for (i = 0; i < HV_SYNIC_SINT_COUNT; i++) {
+        synic_sint_create(vcpu, i, SINT_VEC_BASE + i, i & 1);
+    }
+    atomic_inc(&cpus_comp_count);
+}
+
+static void synic_bench_cleanup(void *ctx)
+{
+    int vcpu = smp_id(), i;
+
+    for (i = 0; i < HV_SYNIC_STIMER_COUNT; i++) {
+        wrmsr(HV_X64_MSR_STIMER0_CONFIG + 2*i, 0);
+    }
+    for (i = 0; i < HV_SYNIC_SINT_COUNT; i++) {
+        synic_sint_destroy(vcpu, i);
+    }
+    wrmsr(HV_X64_MSR_SCONTROL, 0);
+    wrmsr(HV_X64_MSR_SIMP, 0);
+    wrmsr(HV_X64_MSR_SIEFP, 0);
+    atomic_inc(&cpus_comp_count);
+}
+
+/* Run @func on every vCPU at once, this one last, and wait for all. */
+static void run_all(void (*func)(void *data), void *data)
+{
+    int i;
+
+    atomic_set(&cpus_comp_count, 0);
+    for (i = ncpus; i > 0; i--) {
+        on_cpu_async(i - 1, func, data);
+    }
+    while (atomic_read(&cpus_comp_count) != ncpus) {
+        pause();
+    }
+}
+
+static void run_one(int cpu, void (*func)(void *data), void *data)
+{
+    atomic_set(&cpus_comp_count, 0);
+    on_cpu_async(cpu, func, data);
+    while (atomic_read(&cpus_comp_count) != 1) {
+        pause();
+    }
+}
+
+static void report_rate(const char *name, u64 nr, u64 cycles, u64 ref)
+{
+    printf("%s: %llu events, %llu cycles/event", name, nr, cycles / nr);
+    if (has_ref_count && ref) {
+        /* the reference counter ticks every 100ns */
+        printf(", %llu events/sec", nr * 10000000 / ref);
+    }
+    printf("\n");
+}
+
+static u64 read_ref_count(void)
+{
+    return has_ref_count ? rdmsr(HV_X64_MSR_TIME_REF_COUNT) : 0;
+}
+
+static void event_latency(void)
+{
+    static const int sints[] = { SINT_EOI, SINT_AUTO_EOI };
+    struct bench_vcpu *bv;
+    const char *mode;
+    char name[64];
+    int dst, s, i, n;
+    u64 t0;
+
+    for (dst = 0; dst < ncpus; dst++) {
+        bv = &vcpus[dst];
+        for (s = 0; s < ARRAY_SIZE(sints); s++) {
+            mode = sint_mode(sints[s]);
+            for (i = -NR_WARMUP; i < NR_SAMPLES; i++) {
+                n = atomic_read(&bv->isr_count);
+                t0 = rdtsc();
+                synic_sint_set(dst, sints[s]);
+                while (atomic_read(&bv->isr_count) == n) {
+                    pause();
+                }
+                if (i < 0) {
+                    continue;
+                }
+                lat[i] = bv->isr_tsc > t0 ? bv->isr_tsc - t0 : 0;
+                eoi_cost[i] = bv->eoi_cycles;
+            }
+            snprintf(name, sizeof(name), "event_latency %s cpu %d post-to-isr",
+                     mode, dst);
+            stats_report(name, lat, NR_SAMPLES);
+            if (sints[s] == SINT_EOI) {
+                snprintf(name, sizeof(name), "event_latency %s cpu %d eoi",
+                         mode, dst);
+                stats_report(name, eoi_cost, NR_SAMPLES);
+            }
+        }
+    }
+}
+
+static void stimer_fire(int index, int sint)
+{
+    /* an expiration time in the past makes the timer fire right away */
+    wrmsr(HV_X64_MSR_STIMER0_COUNT + 2*index, 1);
+    wrmsr(HV_X64_MSR_STIMER0_CONFIG + 2*index,
+          HV_STIMER_ENABLE | ((u64)sint << 16));
+}
+
+static void message_latency_run(void *ctx)
+{
+    struct bench_vcpu *bv = &vcpus[smp_id()];
+    int sint = (long)ctx, i, n;
+    u64 t0;
+
+    irq_enable();
+    for (i = -NR_WARMUP; i < NR_SAMPLES; i++) {
+        n = atomic_read(&bv->isr_count);
+        wrmsr(HV_X64_MSR_STIMER0_COUNT, 1);
+        t0 = rdtsc();
+        wrmsr(HV_X64_MSR_STIMER0_CONFIG,
+              HV_STIMER_ENABLE | ((u64)sint << 16));
+        while (atomic_read(&bv->isr_count) == n) {
+            pause();
+        }
+        if (i < 0) {
+            continue;
+        }
+        lat[i] = bv->isr_tsc > t0 ? bv->isr_tsc - t0 : 0;
+        eoi_cost[i] = bv->eoi_cycles;
+    }
+    atomic_inc(&cpus_comp_count);
+}
+
+static void message_latency(void)
+{
+    static const int sints[] = { SINT_EOI, SINT_AUTO_EOI };
+    const char *mode;
+    char name[64];
+    int cpu, s;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        for (s = 0; s < ARRAY_SIZE(sints); s++) {
+            mode = sint_mode(sints[s]);
+            run_one(cpu, message_latency_run, (void *)(long)sints[s]);
+            snprintf(name, sizeof(name), "message_latency %s cpu %d arm-to-isr",
+                     mode, cpu);
+            stats_report(name, lat, NR_SAMPLES);
+            if (sints[s] == SINT_EOI) {
+                snprintf(name, sizeof(name), "message_latency %s cpu %d eoi",
+                         mode, cpu);
+                stats_report(name, eoi_cost, NR_SAMPLES);
+            }
+        }
+    }
+}
+
+static void event_flood_run(void *ctx)
+{
+    int dst = (smp_id() + 1) % ncpus, r, i, n;
+    struct bench_vcpu *bv = &vcpus[dst];
+
+    irq_enable();
+    for (r = 0; r < NR_ROUNDS; r++) {
+        n = atomic_read(&bv->isr_count);
+        for (i = 0; i < HV_SYNIC_SINT_COUNT; i++) {
+            synic_sint_set(dst, i);
+        }
+        while (atomic_read(&bv->isr_count) - n < HV_SYNIC_SINT_COUNT) {
+            pause();
+        }
+    }
+    atomic_inc(&cpus_comp_count);
+}
+
+static void event_flood(void)
+{
+    char name[64];
+    u64 t0, ref0;
+
+    ref0 = read_ref_count();
+    t0 = rdtsc();
+    run_all(event_flood_run, NULL);
+    snprintf(name, sizeof(name), "event_flood cpus %d sints %d",
+             ncpus, HV_SYNIC_SINT_COUNT);
+    report_rate(name, (u64)ncpus * NR_ROUNDS * HV_SYNIC_SINT_COUNT,
+                rdtsc() - t0, read_ref_count() - ref0);
+}
+
+static void message_flood_run(void *ctx)
+{
+    struct bench_vcpu *bv = &vcpus[smp_id()];
+    int sint = (long)ctx, r, i, n;
+
+    irq_enable();
+    for (r = 0; r < NR_ROUNDS; r++) {
+        n = atomic_read(&bv->msg_count);
+        for (i = 0; i < HV_SYNIC_STIMER_COUNT; i++) {
+            stimer_fire(i, sint);
+        }
+        while (atomic_read(&bv->msg_count) - n < HV_SYNIC_STIMER_COUNT) {
+            pause();
+        }
+    }
+    atomic_inc(&cpus_comp_count);
+}
+
+static void message_flood(void)
+{
+    static const int sints[] = { SINT_EOI, SINT_AUTO_EOI };
+    u64 t0, ref0, nr_eom, eom_cycles;
+    char name[64];
+    int s, cpu;
+
+    for (s = 0; s < ARRAY_SIZE(sints); s++) {
+        for (cpu = 0; cpu < ncpus; cpu++) {
+            vcpus[cpu].nr_eom = vcpus[cpu].eom_cycles = 0;
+        }
+
+        ref0 = read_ref_count();
+        t0 = rdtsc();
+        run_all(message_flood_run, (void *)(long)sints[s]);
+        snprintf(name, sizeof(name), "message_flood %s cpus %d timers %d",
+                 sint_mode(sints[s]), ncpus, HV_SYNIC_STIMER_COUNT);
+        report_rate(name, (u64)ncpus * NR_ROUNDS * HV_SYNIC_STIMER_COUNT,
+                    rdtsc() - t0, read_ref_count() - ref0);
+
+        nr_eom = eom_cycles = 0;
+        for (cpu = 0; cpu < ncpus; cpu++) {
+            nr_eom += vcpus[cpu].nr_eom;
+            eom_cycles += vcpus[cpu].eom_cycles;
+        }
+        printf("%s: %llu EOM writes, %llu cycles/EOM\n", name, nr_eom,
+               nr_eom ? eom_cycles / nr_eom : 0);
+    }
+}
+
+static struct test tests[] = {
+    { "event_latency", event_latency },
+    { "message_latency", message_latency },
+    { "event_flood", event_flood },
+    { "message_flood", message_flood },
+};
+
+static bool test_wanted(struct test *test, char *wanted[], int nwanted)
+{
+    int i;
+
+    if (!nwanted) {
+        return true;
+    }
+
+    for (i = 0; i < nwanted; ++i) {
+        if (strcmp(wanted[i], test->name) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int ac, char **av)
+{
+    int i;
+
+    if (!synic_supported()) {
+        report("Hyper-V SynIC is not supported", true);
+        return report_summary();
+    }
+
+    setup_vm();
+    smp_init();
+    setup_idt();
+    enable_apic();
+
+    for (i = 0; i < HV_SYNIC_SINT_COUNT; i++) {
+        handle_irq(SINT_VEC_BASE + i,
+                   (i & 1) ? synic_auto_eoi_isr : synic_isr);
+    }
+
+    ncpus = cpu_count();
+    if (ncpus > MAX_CPUS) {
+        ncpus = MAX_CPUS;
+    }
+    has_ref_count = hv_time_ref_counter_supported();
+    printf("ncpus = %d, reference counter %s\n", ncpus,
+           has_ref_count ? "available" : "not available");
+
+    for (i = 0; i < ncpus; i++) {
+        vcpus[i].msg_page = alloc_page();
+        vcpus[i].evt_page = alloc_page();
+        memset(vcpus[i].msg_page, 0, PAGE_SIZE);
+        memset(vcpus[i].evt_page, 0, PAGE_SIZE);
+    }
+    run_all(synic_bench_prepare, (void *)read_cr3());
+
+    irq_enable();
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        if (test_wanted(&tests[i], av + 1, ac - 1)) {
+            tests[i].func();
+        }
+    }
+    irq_disable();
+
+    run_all(synic_bench_cleanup, NULL);
+
+    return report_summary();
+}
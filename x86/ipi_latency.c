@@ -0,0 +1,385 @@
+/*
+ * IPI latency matrix
+ *
+ * For every sender/receiver pair, sends an IPI and waits for the
+ * receiver to answer with an IPI of the same kind.  The one-way latency
+ * is the receiver's TSC in its handler minus the sender's TSC before the
+ * ICR write (this assumes the vCPUs' TSCs are synchronized), the round
+ * trip is measured on the sender alone.  Broadcasts go to all-but-self;
+ * the receivers do not reply, so the round trip there is the time until
+ * every receiver has run its handler.
+ *
+ * Each matrix is printed for xAPIC and then x2APIC, physical, logical and
+ * broadcast destinations, fixed and NMI delivery, and receivers that spin
+ * or sit in HLT; entries are the median in cycles.
+ *
+ * Usage: -append '[selector...]' where a selector is one of xapic,
+ * x2apic, physical, logical, broadcast, fixed, nmi, spin or hlt; only
+ * the selected values of each dimension that has a selector run.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+#include "libcflat.h"
+#include "processor.h"
+#include "msr.h"
+#include "vm.h"
+#include "desc.h"
+#include "isr.h"
+#include "apic.h"
+#include "smp.h"
+#include "stats.h"
+
+#define MAX_CPUS 64
+#define NR_WARMUP 16
+#define NR_SAMPLES 256
+
+#define IPI_VECTOR 0xe0
+#define WAKE_VECTOR 0xe1
+
+#ifdef __x86_64__
+#define CALLER_SAVED "rax", "rcx", "rdx", "rsi", "rdi", \
+		     "r8", "r9", "r10", "r11"
+#else
+#define CALLER_SAVED "eax", "ecx", "edx"
+#endif
+
+enum { DEST_PHYSICAL, DEST_LOGICAL, DEST_BROADCAST };
+enum { DELIVERY_FIXED, DELIVERY_NMI };
+
+static const char *apic_names[] = { "xapic", "x2apic" };
+static const char *dest_names[] = { "physical", "logical", "broadcast" };
+static const char *delivery_names[] = { "fixed", "nmi" };
+static const char *wait_names[] = { "spin", "hlt" };
+
+struct cpu_state {
+	volatile u64 tsc;	/* when the last IPI was handled */
+	volatile unsigned count;
+	volatile int reply_to;
+} __attribute__((aligned(64)));
+
+static int nr_cpus;
+static struct cpu_state state[MAX_CPUS];
+static u32 logical_id[MAX_CPUS];
+static int cur_dest, cur_delivery;
+static volatile bool halt;
+static volatile bool done;
+static volatile int nr_switched;
+
+static u64 oneway[MAX_CPUS][NR_SAMPLES];
+static u64 rtt[NR_SAMPLES];
+static u64 oneway_p50[MAX_CPUS][MAX_CPUS];
+static u64 rtt_p50[MAX_CPUS][MAX_CPUS];
+
+/*
+ * The on_cpu() IPI entry does not save caller-saved registers, so
+ * interrupts are only let in where the compiler already assumes those
+ * are clobbered.
+ */
+static inline void irq_window(bool hlt)
+{
+	if (hlt)
+		asm volatile ("sti; hlt; cli" : : : CALLER_SAVED, "memory", "cc");
+	else
+		asm volatile ("sti; pause; cli" : : : CALLER_SAVED, "memory", "cc");
+}
+
+static void send_ipi(int dest, int cpu)
+{
+	u32 icr = APIC_INT_ASSERT;
+
+	if (cur_delivery == DELIVERY_NMI)
+		icr |= APIC_DM_NMI;
+	else
+		icr |= APIC_DM_FIXED | IPI_VECTOR;
+
+	switch (dest) {
+	case DEST_PHYSICAL:
+		apic_icr_write(icr | APIC_DEST_PHYSICAL, cpu);
+		break;
+	case DEST_LOGICAL:
+		apic_icr_write(icr | APIC_DEST_LOGICAL, logical_id[cpu]);
+		break;
+	case DEST_BROADCAST:
+		apic_icr_write(icr | APIC_DEST_ALLBUT, 0);
+		break;
+	}
+}
+
+static void received(void)
+{
+	int cpu = smp_id();
+	struct cpu_state *s;
+
+	if (cpu >= MAX_CPUS)
+		return;
+
+	s = &state[cpu];
+	s->tsc = rdtsc();
+	s->count++;
+	if (s->reply_to >= 0)
+		send_ipi(DEST_PHYSICAL, s->reply_to);
+}
+
+static void ipi_isr(isr_regs_t *regs)
+{
+	received();
+	eoi();
+}
+
+static void nmi_handler(struct ex_regs *regs)
+{
+	received();
+}
+
+static void wake_isr(isr_regs_t *regs)
+{
+	eoi();
+}
+
+/* Secondary CPUs sit here, nested in the on_cpu_async() IPI handler. */
+static void wait_loop(void *data)
+{
+	for (;;)
+		irq_window(halt);
+}
+
+static u64 p50(u64 *samples)
+{
+	stats_sort(samples, NR_SAMPLES);
+	return stats_percentile(samples, NR_SAMPLES, 50);
+}
+
+/* Runs on the sender; @data is the receiver, or -1 for a broadcast. */
+static void measure(void *data)
+{
+	int me = smp_id(), target = (long)data, cpu, i;
+	unsigned counts[MAX_CPUS];
+	u64 t0, t1;
+	s64 delta;
+
+	for (i = -NR_WARMUP; i < NR_SAMPLES; i++) {
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			counts[cpu] = state[cpu].count;
+
+		t0 = rdtsc();
+		send_ipi(cur_dest, target);
+		if (target >= 0) {
+			while (state[me].count == counts[me])
+				irq_window(false);
+		} else {
+			for (cpu = 0; cpu < nr_cpus; cpu++)
+				while (cpu != me &&
+				       state[cpu].count == counts[cpu])
+					irq_window(false);
+		}
+		t1 = rdtsc();
+
+		if (i < 0)
+			continue;
+		rtt[i] = t1 - t0;
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (cpu == me || (target >= 0 && cpu != target))
+				continue;
+			delta = state[cpu].tsc - t0;
+			oneway[cpu][i] = delta > 0 ? delta : 0;
+		}
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		if (cpu != me && (target < 0 || cpu == target))
+			oneway_p50[me][cpu] = p50(oneway[cpu]);
+	rtt_p50[me][target < 0 ? 0 : target] = p50(rtt);
+
+	done = true;
+	if (me != 0)
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL |
+			       APIC_DM_FIXED | WAKE_VECTOR, 0);
+}
+
+static void run_on(int sender, long target)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		state[cpu].reply_to = cpu == target ? sender : -1;
+
+	if (sender == smp_id()) {
+		measure((void *)target);
+		return;
+	}
+
+	done = false;
+	on_cpu_async(sender, measure, (void *)target);
+	while (!done)
+		irq_window(halt);
+}
+
+static void print_matrix(const char *name, const char *what, u64 m[][MAX_CPUS])
+{
+	int s, r;
+
+	printf("%s %s p50 cycles (row: sender, column: receiver)\n", name, what);
+	printf("     ");
+	for (r = 0; r < nr_cpus; r++)
+		printf(" %7d", r);
+	printf("\n");
+	for (s = 0; s < nr_cpus; s++) {
+		printf("%4d:", s);
+		for (r = 0; r < nr_cpus; r++)
+			if (r == s)
+				printf("       -");
+			else
+				printf(" %7llu", m[s][r]);
+		printf("\n");
+	}
+}
+
+static void do_test(const char *apic)
+{
+	char name[64];
+	int s, r;
+
+	snprintf(name, sizeof(name), "%s %s %s %s", apic,
+		 dest_names[cur_dest], delivery_names[cur_delivery],
+		 wait_names[halt]);
+
+	if (cur_dest == DEST_BROADCAST) {
+		for (s = 0; s < nr_cpus; s++)
+			run_on(s, -1);
+		print_matrix(name, "one-way", oneway_p50);
+		for (s = 0; s < nr_cpus; s++)
+			printf("%s sender %d all received p50 %llu cycles\n",
+			       name, s, rtt_p50[s][0]);
+		return;
+	}
+
+	for (s = 0; s < nr_cpus; s++)
+		for (r = 0; r < nr_cpus; r++)
+			if (r != s)
+				run_on(s, r);
+	print_matrix(name, "one-way", oneway_p50);
+	print_matrix(name, "round-trip", rtt_p50);
+}
+
+static void setup_logical_id(void *data)
+{
+	int cpu = smp_id();
+
+	if (data) {
+		logical_id[cpu] = apic_read(APIC_LDR);
+	} else {
+		logical_id[cpu] = cpu < 8 ? 1u << cpu : 0;
+		apic_write(APIC_DFR, APIC_DFR_FLAT);
+		apic_write(APIC_LDR, logical_id[cpu] << 24);
+	}
+}
+
+/* Runs after the on_cpu_async() EOI, which still has to go through MMIO. */
+static void switch_x2apic(void *data)
+{
+	wrmsr(MSR_IA32_APICBASE, rdmsr(MSR_IA32_APICBASE) | APIC_EXTD);
+	nr_switched++;
+}
+
+/*
+ * apic_ops is global, so every other CPU is switched while this one
+ * still sends through the xAPIC page, and this one goes last.
+ */
+static bool switch_all_x2apic(void)
+{
+	int cpu;
+
+	if (!(cpuid(1).c & (1 << 21)))
+		return false;
+
+	nr_switched = 0;
+	for (cpu = 1; cpu < cpu_count(); cpu++) {
+		on_cpu_async(cpu, switch_x2apic, NULL);
+		while (nr_switched != cpu)
+			pause();
+	}
+	return enable_x2apic();
+}
+
+static bool wanted(const char *name, const char *names[], int nr_names,
+		   char *args[], int nr_args)
+{
+	bool any = false;
+	int i, j;
+
+	for (i = 0; i < nr_args; i++)
+		for (j = 0; j < nr_names; j++)
+			if (strcmp(args[i], names[j]) == 0) {
+				any = true;
+				if (strcmp(args[i], name) == 0)
+					return true;
+			}
+	return !any;
+}
+
+#define WANTED(name, names) \
+	wanted(name, names, ARRAY_SIZE(names), av + 1, ac - 1)
+
+int main(int ac, char **av)
+{
+	int apic, cpu, w;
+
+	setup_vm();
+	smp_init();
+	setup_idt();
+	mask_pic_interrupts();
+
+	nr_cpus = cpu_count();
+	if (nr_cpus > MAX_CPUS)
+		nr_cpus = MAX_CPUS;
+	printf("ncpus = %d\n", nr_cpus);
+	if (nr_cpus < 2) {
+		printf("need at least 2 cpus\n");
+		return 0;
+	}
+
+	handle_irq(IPI_VECTOR, ipi_isr);
+	handle_irq(WAKE_VECTOR, wake_isr);
+	handle_exception(2, nmi_handler);
+
+	for (cpu = 1; cpu < cpu_count(); cpu++)
+		on_cpu_async(cpu, wait_loop, NULL);
+
+	for (apic = 0; apic < ARRAY_SIZE(apic_names); apic++) {
+		if (!WANTED(apic_names[apic], apic_names))
+			continue;
+		if (apic == 1 && !switch_all_x2apic()) {
+			printf("x2apic (skipped, not supported)\n");
+			break;
+		}
+
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			on_cpu(cpu, setup_logical_id, (void *)(long)apic);
+
+		for (cur_dest = 0; cur_dest < ARRAY_SIZE(dest_names); cur_dest++) {
+			if (!WANTED(dest_names[cur_dest], dest_names))
+				continue;
+			if (apic == 0 && cur_dest == DEST_LOGICAL && nr_cpus > 8) {
+				printf("xapic logical (skipped, flat model "
+				       "has only 8 ids)\n");
+				continue;
+			}
+			for (cur_delivery = 0;
+			     cur_delivery < ARRAY_SIZE(delivery_names);
+			     cur_delivery++) {
+				if (!WANTED(delivery_names[cur_delivery],
+					    delivery_names))
+					continue;
+				for (w = 0; w < ARRAY_SIZE(wait_names); w++) {
+					if (!WANTED(wait_names[w], wait_names))
+						continue;
+					halt = w;
+					do_test(apic_names[apic]);
+				}
+			}
+		}
+	}
+
+	halt = false;
+	return 0;
+}
@@ -3,6 +3,8 @@
 #include "libcflat.h"
 #include "processor.h"
 #include "desc.h"
+#include "vm.h"
+#include "stats.h"
 
 #define X86_FEATURE_PCID       (1 << 17)
 #define X86_FEATURE_INVPCID    (1 << 10)
@@ -137,6 +139,232 @@ report:
     report("Test on INVPCID when disabled", passed);
 }
 
+/*
+ * Benchmark mode (-append 'bench [pages]'): median cycles of CR3
+ * switches with and without PCIDs and the no-flush bit, of INVLPG and of
+ * each INVPCID type, and the per-page cost of touching a working set of
+ * 4k pages (512 by default) again after each kind of flush.
+ */
+#define BENCH_SAMPLES 1024
+#define BENCH_REFILL_SAMPLES 64
+#define BENCH_DEFAULT_PAGES 512
+
+#define CR3_NOFLUSH (1ul << 63)
+#define PCID_A 1
+#define PCID_B 2
+
+enum {
+    INVPCID_ADDR,
+    INVPCID_CONTEXT,
+    INVPCID_ALL_GLOBAL,
+    INVPCID_ALL,
+};
+
+struct tlb_op {
+    const char *name;
+    void (*func)(int i);
+    bool pcid;
+    bool invpcid;
+};
+
+static u64 bench_samples[BENCH_SAMPLES];
+static char *ws;
+static unsigned long ws_pages;
+static ulong cr3_a, cr3_b;
+
+static void invpcid(unsigned long type, unsigned long pcid, void *addr)
+{
+    struct invpcid_desc desc = {
+        .pcid = pcid,
+        .addr = (unsigned long)addr,
+    };
+
+    asm volatile (".byte 0x66,0x0f,0x38,0x82,0x18 \n\t" /* invpcid (%rax), %rbx */
+                  : : "a" (&desc), "b" (type) : "memory");
+}
+
+static void *ws_page(int i)
+{
+    return ws + (i % ws_pages) * PAGE_SIZE;
+}
+
+static void touch_ws(void)
+{
+    unsigned long i;
+
+    for (i = 0; i < ws_pages; i++)
+        (void)*(volatile char *)(ws + i * PAGE_SIZE);
+}
+
+static void op_cr3(int i)
+{
+    write_cr3((i & 1) ? cr3_b : cr3_a);
+}
+
+static void op_cr3_pcid(int i)
+{
+    write_cr3((i & 1) ? cr3_b | PCID_B : cr3_a | PCID_A);
+}
+
+static void op_cr3_pcid_noflush(int i)
+{
+    write_cr3(((i & 1) ? cr3_b | PCID_B : cr3_a | PCID_A) | CR3_NOFLUSH);
+}
+
+static void op_invlpg(int i)
+{
+    invlpg(ws_page(i));
+}
+
+static void op_invpcid_addr(int i)
+{
+    invpcid(INVPCID_ADDR, PCID_A, ws_page(i));
+}
+
+static void op_invpcid_context(int i)
+{
+    invpcid(INVPCID_CONTEXT, PCID_A, NULL);
+}
+
+static void op_invpcid_all_global(int i)
+{
+    invpcid(INVPCID_ALL_GLOBAL, 0, NULL);
+}
+
+static void op_invpcid_all(int i)
+{
+    invpcid(INVPCID_ALL, 0, NULL);
+}
+
+static struct tlb_op tlb_ops[] = {
+    { "cr3", op_cr3, false, false },
+    { "cr3_pcid", op_cr3_pcid, true, false },
+    { "cr3_pcid_noflush", op_cr3_pcid_noflush, true, false },
+    { "invlpg", op_invlpg, false, false },
+    { "invlpg_pcid", op_invlpg, true, false },
+    { "invpcid_addr", op_invpcid_addr, true, true },
+    { "invpcid_context", op_invpcid_context, true, true },
+    { "invpcid_all_global", op_invpcid_all_global, true, true },
+    { "invpcid_all", op_invpcid_all, true, true },
+};
+
+/*
+ * Flushes that are followed by a working set refill; the user/kernel
+ * round trip of a KPTI kernel is the pair of CR3 writes.
+ */
+static void flush_none(int i)
+{
+}
+
+static void flush_kpti(int i)
+{
+    write_cr3(cr3_b);
+    write_cr3(cr3_a);
+}
+
+static void flush_kpti_pcid(int i)
+{
+    write_cr3(cr3_b | PCID_B | CR3_NOFLUSH);
+    write_cr3(cr3_a | PCID_A | CR3_NOFLUSH);
+}
+
+static void flush_cr3_pcid(int i)
+{
+    write_cr3(cr3_a | PCID_A);
+}
+
+static struct tlb_op refill_ops[] = {
+    { "none", flush_none, false, false },
+    { "kpti", flush_kpti, false, false },
+    { "kpti_pcid", flush_kpti_pcid, true, false },
+    { "cr3_pcid", flush_cr3_pcid, true, false },
+    { "invpcid_context", op_invpcid_context, true, true },
+    { "invpcid_all", op_invpcid_all, true, true },
+};
+
+/* Back to PCID 0 in CR3 before changing CR4.PCIDE, then to PCID_A. */
+static void tlb_mode(bool pcid)
+{
+    write_cr3(cr3_a);
+    if (pcid) {
+        write_cr4(read_cr4() | X86_CR4_PCIDE);
+        write_cr3(cr3_a | PCID_A);
+    } else {
+        write_cr4(read_cr4() & ~X86_CR4_PCIDE);
+    }
+}
+
+static bool tlb_op_valid(struct tlb_op *op, bool has_pcid, bool has_invpcid)
+{
+    return (!op->pcid || has_pcid) && (!op->invpcid || has_invpcid);
+}
+
+static u64 bench_p50(int nr)
+{
+    stats_sort(bench_samples, nr);
+    return stats_percentile(bench_samples, nr, 50);
+}
+
+static void tlb_bench(int ac, char **av, bool has_pcid, bool has_invpcid)
+{
+    unsigned long *pml4;
+    struct tlb_op *op;
+    u64 t0;
+    int i, j;
+
+    ws_pages = ac > 2 ? atol(av[2]) : BENCH_DEFAULT_PAGES;
+    if (!ws_pages)
+        ws_pages = BENCH_DEFAULT_PAGES;
+
+    setup_vm();
+    ws = vmalloc(ws_pages * PAGE_SIZE);
+    memset(ws, 0, ws_pages * PAGE_SIZE);
+
+    /* A second address space that shares everything below the PML4. */
+    cr3_a = read_cr3();
+    pml4 = alloc_page();
+    memcpy(pml4, phys_to_virt(cr3_a), PAGE_SIZE);
+    cr3_b = virt_to_phys(pml4);
+
+    printf("pcid %d invpcid %d working set %lu pages\n", has_pcid,
+           has_invpcid, ws_pages);
+
+    for (i = 0; i < ARRAY_SIZE(tlb_ops); i++) {
+        op = &tlb_ops[i];
+        if (!tlb_op_valid(op, has_pcid, has_invpcid)) {
+            printf("%s (skipped)\n", op->name);
+            continue;
+        }
+        tlb_mode(op->pcid);
+        for (j = 0; j < BENCH_SAMPLES; j++) {
+            t0 = rdtsc();
+            op->func(j);
+            bench_samples[j] = rdtsc() - t0;
+        }
+        printf("%s %llu cycles\n", op->name, bench_p50(BENCH_SAMPLES));
+    }
+
+    for (i = 0; i < ARRAY_SIZE(refill_ops); i++) {
+        op = &refill_ops[i];
+        if (!tlb_op_valid(op, has_pcid, has_invpcid)) {
+            printf("refill after %s (skipped)\n", op->name);
+            continue;
+        }
+        tlb_mode(op->pcid);
+        for (j = 0; j < BENCH_REFILL_SAMPLES; j++) {
+            touch_ws();
+            op->func(j);
+            t0 = rdtsc();
+            touch_ws();
+            bench_samples[j] = rdtsc() - t0;
+        }
+        printf("refill after %s %llu cycles/page\n", op->name,
+               bench_p50(BENCH_REFILL_SAMPLES) / ws_pages);
+    }
+
+    tlb_mode(false);
+}
+
 int main(int ac, char **av)
 {
     struct cpuid _cpuid;
@@ -151,6 +379,11 @@ int main(int ac, char **av)
     if (_cpuid.b & X86_FEATURE_INVPCID)
         invpcid_enabled = 1;
 
+    if (ac > 1 && strcmp(av[1], "bench") == 0) {
+        tlb_bench(ac, av, pcid_enabled, invpcid_enabled);
+        return 0;
+    }
+
     test_cpuid_consistency(pcid_enabled, invpcid_enabled);
 
     if (pcid_enabled)
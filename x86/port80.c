@@ -1,12 +1,234 @@
+/*
+ * Port I/O exit cost
+ *
+ * Times single in/out accesses of every width and rep ins/outs string
+ * I/O of several lengths against ports handled in the kernel, ports
+ * handled by userspace and (through pci-testdev) ports backed by an
+ * ioeventfd.  Reports cycles per access and, for string I/O, bytes/sec
+ * using a TSC frequency calibrated against the ACPI PM timer.
+ *
+ * Usage: -append '[class...]' where class is one of kernel, user,
+ * eventfd or string; without arguments everything runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
 #include "libcflat.h"
+#include "processor.h"
+#include "pci.h"
+#include "x86/vm.h"
+#include "x86/acpi.h"
+#include "x86/io.h"
 
-int main()
+#define GOAL (1ull << 30)
+
+/* In-kernel i8259 ELCR and i8254 channel 0, userspace port 80 sink. */
+#define PORT_KERNEL		0x4d0
+#define PORT_KERNEL_DWORD	0x40
+#define PORT_USER		0x80
+
+#define MAX_STRING		65536
+
+enum { IO_IN, IO_OUT, IO_INS, IO_OUTS };
+
+struct test {
+	const char *class;
+	const char *name;
+	int dir;
+	int width;
+	unsigned port;
+	unsigned count;
+	u32 data;
+};
+
+static u8 buf[MAX_STRING * 4] __attribute__((aligned(4096)));
+static unsigned long long tsc_khz;
+
+static struct test tests[] = {
+	{ "kernel", "inb", IO_IN, 1, PORT_KERNEL },
+	{ "kernel", "inw", IO_IN, 2, PORT_KERNEL },
+	{ "kernel", "inl", IO_IN, 4, PORT_KERNEL_DWORD },
+	{ "kernel", "outb", IO_OUT, 1, PORT_KERNEL },
+	{ "kernel", "outw", IO_OUT, 2, PORT_KERNEL },
+	{ "user", "inb", IO_IN, 1, PORT_USER },
+	{ "user", "inw", IO_IN, 2, PORT_USER },
+	{ "user", "inl", IO_IN, 4, PORT_USER },
+	{ "user", "outb", IO_OUT, 1, PORT_USER },
+	{ "user", "outw", IO_OUT, 2, PORT_USER },
+	{ "user", "outl", IO_OUT, 4, PORT_USER },
+	{ "string", "rep insb", IO_INS, 1, PORT_KERNEL, 16 },
+	{ "string", "rep insb", IO_INS, 1, PORT_KERNEL, 4096 },
+	{ "string", "rep outsb", IO_OUTS, 1, PORT_KERNEL, 16 },
+	{ "string", "rep outsb", IO_OUTS, 1, PORT_KERNEL, 4096 },
+	{ "string", "rep insb", IO_INS, 1, PORT_USER, 16 },
+	{ "string", "rep insb", IO_INS, 1, PORT_USER, 4096 },
+	{ "string", "rep insb", IO_INS, 1, PORT_USER, MAX_STRING },
+	{ "string", "rep insw", IO_INS, 2, PORT_USER, 4096 },
+	{ "string", "rep insl", IO_INS, 4, PORT_USER, 4096 },
+	{ "string", "rep outsb", IO_OUTS, 1, PORT_USER, 16 },
+	{ "string", "rep outsb", IO_OUTS, 1, PORT_USER, 4096 },
+	{ "string", "rep outsb", IO_OUTS, 1, PORT_USER, MAX_STRING },
+	{ "string", "rep outsw", IO_OUTS, 2, PORT_USER, 4096 },
+	{ "string", "rep outsl", IO_OUTS, 4, PORT_USER, 4096 },
+};
+
+static void do_io(struct test *t)
+{
+	unsigned long cnt = t->count;
+	void *p = buf;
+
+	switch (t->dir) {
+	case IO_IN:
+		switch (t->width) {
+		case 1: inb(t->port); break;
+		case 2: inw(t->port); break;
+		case 4: inl(t->port); break;
+		}
+		break;
+	case IO_OUT:
+		switch (t->width) {
+		case 1: outb(t->data, t->port); break;
+		case 2: outw(t->data, t->port); break;
+		case 4: outl(t->data, t->port); break;
+		}
+		break;
+	case IO_INS:
+		switch (t->width) {
+		case 1:
+			asm volatile ("rep insb" : "+D"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		case 2:
+			asm volatile ("rep insw" : "+D"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		case 4:
+			asm volatile ("rep insl" : "+D"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		}
+		break;
+	case IO_OUTS:
+		switch (t->width) {
+		case 1:
+			asm volatile ("rep outsb" : "+S"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		case 2:
+			asm volatile ("rep outsw" : "+S"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		case 4:
+			asm volatile ("rep outsl" : "+S"(p), "+c"(cnt)
+				      : "d"(t->port) : "memory");
+			break;
+		}
+		break;
+	}
+}
+
+static void do_test(struct test *t)
 {
-    int i;
+	unsigned long long t1, t2, cycles, bytes;
+	unsigned i, iterations = 32;
+
+	do {
+		iterations *= 2;
+		t1 = rdtsc();
+		for (i = 0; i < iterations; ++i)
+			do_io(t);
+		t2 = rdtsc();
+	} while ((t2 - t1) < GOAL);
+
+	cycles = (t2 - t1) / iterations;
+	printf("%s %s", t->class, t->name);
+	if (t->count)
+		printf(" x%u", t->count);
+	printf(" port 0x%x: %llu cycles", t->port, cycles);
+
+	if (t->count) {
+		bytes = (unsigned long long)t->count * t->width;
+		printf(", %llu cycles/access", cycles / t->count);
+		if (tsc_khz && cycles)
+			printf(", %llu bytes/sec", bytes * tsc_khz * 1000 / cycles);
+	}
+	printf("\n");
+}
+
+/*
+ * ioeventfd-backed ports come from the pci-testdev I/O BAR, which lists
+ * a set of port tests (plain, wildcard eventfd, datamatch eventfd) by
+ * name, width, offset and the value to write.
+ */
+static void do_eventfd_tests(void)
+{
+	struct test t = { .class = "eventfd", .dir = IO_OUT };
+	pcidevaddr_t pcidev;
+	unsigned iobar = 0;
+	char name[32];
+	int i, idx;
+
+	pcidev = pci_find_dev(PCI_VENDOR_ID_REDHAT, PCI_DEVICE_ID_REDHAT_TEST);
+	if (pcidev == PCIDEVADDR_INVALID) {
+		printf("eventfd (skipped, no pci-testdev)\n");
+		return;
+	}
+	for (i = 0; i < PCI_TESTDEV_NUM_BARS; i++)
+		if (pci_bar_is_valid(pcidev, i) && !pci_bar_is_memory(pcidev, i))
+			iobar = pci_bar_addr(pcidev, i);
+	if (!iobar) {
+		printf("eventfd (skipped, no I/O BAR)\n");
+		return;
+	}
+
+	for (idx = 0; ; idx++) {
+		outb(idx, iobar + offsetof(struct pci_test_dev_hdr, test));
+		t.width = inb(iobar + offsetof(struct pci_test_dev_hdr, width));
+		if (t.width != 1 && t.width != 2 && t.width != 4)
+			break;
+		t.data = inl(iobar + offsetof(struct pci_test_dev_hdr, data));
+		t.port = iobar +
+			 inl(iobar + offsetof(struct pci_test_dev_hdr, offset));
+		for (i = 0; i < sizeof(name) - 1; i++) {
+			name[i] = inb(iobar +
+				      offsetof(struct pci_test_dev_hdr, name) + i);
+			if (!name[i])
+				break;
+		}
+		name[i] = 0;
+		t.name = name;
+		do_test(&t);
+	}
+}
+
+static bool class_wanted(const char *class, char *wanted[], int nwanted)
+{
+	int i;
+
+	if (!nwanted)
+		return true;
+
+	for (i = 0; i < nwanted; ++i)
+		if (strcmp(wanted[i], class) == 0)
+			return true;
+
+	return false;
+}
+
+int main(int ac, char **av)
+{
+	int i;
+
+	setup_vm();
+	tsc_khz = acpi_tsc_khz();
+	if (tsc_khz)
+		printf("TSC frequency %llu kHz\n", tsc_khz);
+
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (class_wanted(tests[i].class, av + 1, ac - 1))
+			do_test(&tests[i]);
+
+	if (class_wanted("eventfd", av + 1, ac - 1))
+		do_eventfd_tests();
 
-    printf("begining port 0x80 write test\n");
-    for (i = 0; i < 10000000; ++i)
-	asm volatile("outb %al, $0x80");
-    printf("done\n");
-    return 0;
+	return 0;
 }
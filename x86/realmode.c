@@ -1551,94 +1551,239 @@ static void test_nopl(void)
 	report("nopl", 0, 1);
 }
 
-static u32 perf_baseline;
-
-#define PERF_COUNT 1000000
+/*
+ * Emulated instruction cost table.  Each entry runs its instructions
+ * PERF_COUNT times in big real mode, once per run, and reports the
+ * min/median/max cycles per instruction over the runs after taking
+ * away the loop that drives it.  The command line can set the number
+ * of runs ("runs=N") and the threshold of the summary ("threshold=N"):
+ * a class of instructions is flagged when it costs more than N times
+ * the emulated "loop" instruction of the driver.
+ */
+#define PERF_SHIFT	16
+#define PERF_COUNT	(1 << PERF_SHIFT)
+#define PERF_MAX_RUNS	16
+
+static u32 perf_scratch;
+static u32 perf_stack[64];
+/* used by the instructions below */
+u64 perf_tsc;
+u8 perf_buf[128];
+struct {
+	u16 offset, sel;
+} __attribute__((packed)) perf_farptr;
 
+/* The start time is kept in memory so that the body can use %ebx/%esi */
 #define MK_INSN_PERF(name, insn)                                \
-	MK_INSN(name, "rdtsc; mov %eax, %ebx; mov %edx, %esi\n" \
+	MK_INSN(name, "rdtsc; mov %eax, perf_tsc\n"             \
+		      "mov %edx, perf_tsc+4\n"                  \
 		      "1:" insn "\n"                            \
 		      ".byte 0x67; loop 1b\n"                   \
 		      "rdtsc");
 
-static u32 cycles_in_big_real_mode(struct insn_desc *insn)
-{
-	u64 start, end;
+asm ("perf_ret: ret");
+
+MK_INSN_PERF(perf_loop, "");
+MK_INSN_PERF(perf_mov, "mov %esi, %edi");
+MK_INSN_PERF(perf_arith, "add $4, %edi");
+MK_INSN_PERF(perf_memory_load, "cmp $0, (%edi)");
+MK_INSN_PERF(perf_memory_store, "mov %ax, (%edi)");
+MK_INSN_PERF(perf_memory_rmw, "add $1, (%edi)");
+MK_INSN_PERF(perf_memory_gs, "mov %gs:(%edi), %eax");
+MK_INSN_PERF(perf_movsb, "mov $perf_buf, %si; mov $perf_buf+64, %di; movsb");
+MK_INSN_PERF(perf_stosw, "mov $perf_buf+64, %di; stosw");
+MK_INSN_PERF(perf_lodsw, "mov $perf_buf, %si; lodsw");
+MK_INSN_PERF(perf_cmpsb, "mov $perf_buf, %si; mov $perf_buf+64, %di; cmpsb");
+MK_INSN_PERF(perf_rep_movsb, "mov %ecx, %ebp; mov $16, %cx\n"
+			     "mov $perf_buf, %si; mov $perf_buf+64, %di\n"
+			     "rep movsb; mov %ebp, %ecx");
+MK_INSN_PERF(perf_call_far, "lcallw $0, $retf");
+MK_INSN_PERF(perf_jmp_far, "call 2f; jmp 3f; 2: jmp $0, $perf_ret; 3:");
+MK_INSN_PERF(perf_int, "int $0x11");
+MK_INSN_PERF(perf_iret, "pushfw; pushw %cs; callw 2f; jmp 3f; 2: iretw; 3:");
+MK_INSN_PERF(perf_mov_sreg, "mov %ax, %fs");
+MK_INSN_PERF(perf_push_sreg, "pushw %fs; popw %fs");
+MK_INSN_PERF(perf_lfs, "lfs perf_farptr, %ax");
+MK_INSN_PERF(perf_out, "out %al, $0xe0");
+MK_INSN_PERF(perf_in, "in $0xe0, %al");
+MK_INSN_PERF(perf_push, "push %eax; pop %eax");
+MK_INSN_PERF(perf_pushf, "pushfw; popfw");
+MK_INSN_PERF(perf_pusha, "pushal; popal");
+MK_INSN_PERF(perf_call, "call 2f; jmp 3f; 2: ret; 3:");
+
+enum {
+	PERF_ALU, PERF_MEMORY, PERF_STRING, PERF_FAR, PERF_INT,
+	PERF_SEGMENT, PERF_IO, PERF_STACK, NR_PERF_CLASSES
+};
 
-	inregs.ecx = PERF_COUNT;
-	exec_in_big_real_mode(insn);
-	start = ((u64)outregs.esi << 32) | outregs.ebx;
-	end = ((u64)outregs.edx << 32) | outregs.eax;
+static const char *perf_class_names[NR_PERF_CLASSES] = {
+	"alu", "memory", "string", "far jump/call", "int/iret",
+	"segment load", "i/o", "stack",
+};
 
-	return end - start;
-}
+static struct perf_insn {
+	const char *name;
+	int class;
+	struct insn_desc *insn;
+	u32 insns;	/* emulated instructions per iteration */
+} perf_insns[] = {
+	{ "mov reg", PERF_ALU, &insn_perf_mov, 1 },
+	{ "add imm", PERF_ALU, &insn_perf_arith, 1 },
+	{ "load", PERF_MEMORY, &insn_perf_memory_load, 1 },
+	{ "store", PERF_MEMORY, &insn_perf_memory_store, 1 },
+	{ "rmw", PERF_MEMORY, &insn_perf_memory_rmw, 1 },
+	{ "gs: load", PERF_MEMORY, &insn_perf_memory_gs, 1 },
+	{ "movsb", PERF_STRING, &insn_perf_movsb, 3 },
+	{ "stosw", PERF_STRING, &insn_perf_stosw, 2 },
+	{ "lodsw", PERF_STRING, &insn_perf_lodsw, 2 },
+	{ "cmpsb", PERF_STRING, &insn_perf_cmpsb, 3 },
+	{ "rep movsb 16", PERF_STRING, &insn_perf_rep_movsb, 6 },
+	{ "lcall/lret", PERF_FAR, &insn_perf_call_far, 2 },
+	{ "ljmp", PERF_FAR, &insn_perf_jmp_far, 4 },
+	{ "int/iret", PERF_INT, &insn_perf_int, 2 },
+	{ "iret", PERF_INT, &insn_perf_iret, 5 },
+	{ "mov sreg", PERF_SEGMENT, &insn_perf_mov_sreg, 1 },
+	{ "push/pop sreg", PERF_SEGMENT, &insn_perf_push_sreg, 2 },
+	{ "lfs", PERF_SEGMENT, &insn_perf_lfs, 1 },
+	{ "out", PERF_IO, &insn_perf_out, 1 },
+	{ "in", PERF_IO, &insn_perf_in, 1 },
+	{ "push/pop", PERF_STACK, &insn_perf_push, 2 },
+	{ "pushf/popf", PERF_STACK, &insn_perf_pushf, 2 },
+	{ "pusha/popa", PERF_STACK, &insn_perf_pusha, 2 },
+	{ "call/ret", PERF_STACK, &insn_perf_call, 3 },
+};
 
-static void test_perf_loop(void)
+/* The command line is copied here by the startup code */
+char cmdline[256];
+
+/* N in a "@name=N" word of the command line, or @def */
+static u32 cmdline_u32(const char *name, u32 def)
 {
-	/*
-	 * This test runs simple instructions that should roughly take the
-	 * the same time to emulate: PERF_COUNT iterations of "loop" and 3
-	 * setup instructions.  Other performance tests can run PERF_COUNT
-	 * iterations of the same instruction and subtract the cycle count
-	 * of this test.
-	 */
-	MK_INSN_PERF(perf_loop, "");
-	perf_baseline = cycles_in_big_real_mode(&insn_perf_loop);
-	print_serial_u32(perf_baseline / (PERF_COUNT + 3));
-	print_serial(" cycles/emulated jump instruction\n");
+	const char *p = cmdline, *n;
+	u32 val;
+
+	while (*p) {
+		for (n = name; *n && *p == *n; ++n)
+			++p;
+		if (!*n && *p == '=' && p[1] >= '0' && p[1] <= '9') {
+			for (val = 0, ++p; *p >= '0' && *p <= '9'; ++p)
+				val = val * 10 + *p - '0';
+			return val;
+		}
+		while (*p && *p != ' ')
+			++p;
+		while (*p == ' ')
+			++p;
+	}
+	return def;
 }
 
-static void test_perf_mov(void)
+static void print_serial_u32_w(u32 value, int width)
 {
-	u32 cyc;
+	char n[12], *p;
 
-	MK_INSN_PERF(perf_move, "mov %esi, %edi");
-	cyc = cycles_in_big_real_mode(&insn_perf_move);
-	print_serial_u32((cyc - perf_baseline) / PERF_COUNT);
-	print_serial(" cycles/emulated move instruction\n");
+	p = &n[11];
+	*p = 0;
+	do {
+		*--p = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0);
+	while (&n[11] - p < width)
+		*--p = ' ';
+	print_serial(p);
 }
 
-static void test_perf_arith(void)
+static void print_serial_w(const char *buf, int width)
 {
-	u32 cyc;
+	int n;
 
-	MK_INSN_PERF(perf_arith, "add $4, %edi");
-	cyc = cycles_in_big_real_mode(&insn_perf_arith);
-	print_serial_u32((cyc - perf_baseline) / PERF_COUNT);
-	print_serial(" cycles/emulated arithmetic instruction\n");
+	print_serial(buf);
+	for (n = strlen(buf); n < width; ++n)
+		print_serial(" ");
 }
 
-static void test_perf_memory_load(void)
+/* Cycles per iteration of the loop in @insn */
+static u32 cycles_in_big_real_mode(struct insn_desc *insn)
 {
-	u32 cyc, tmp;
-
-	MK_INSN_PERF(perf_memory_load, "cmp $0, (%edi)");
-	inregs.edi = (u32)&tmp;
-	cyc = cycles_in_big_real_mode(&insn_perf_memory_load);
-	print_serial_u32((cyc - perf_baseline) / PERF_COUNT);
-	print_serial(" cycles/emulated memory load instruction\n");
+	inregs = (struct regs){ .ecx = PERF_COUNT, .edi = (u32)&perf_scratch,
+				.esp = (u32)&perf_stack[64] };
+	exec_in_big_real_mode(insn);
+	return ((((u64)outregs.edx << 32) | outregs.eax) - perf_tsc)
+		>> PERF_SHIFT;
 }
 
-static void test_perf_memory_store(void)
+static void sort_u32(u32 *v, int n)
 {
-	u32 cyc, tmp;
-
-	MK_INSN_PERF(perf_memory_store, "mov %ax, (%edi)");
-	inregs.edi = (u32)&tmp;
-	cyc = cycles_in_big_real_mode(&insn_perf_memory_store);
-	print_serial_u32((cyc - perf_baseline) / PERF_COUNT);
-	print_serial(" cycles/emulated memory store instruction\n");
+	int i, j;
+	u32 tmp;
+
+	for (i = 1; i < n; ++i)
+		for (j = i; j > 0 && v[j - 1] > v[j]; --j) {
+			tmp = v[j];
+			v[j] = v[j - 1];
+			v[j - 1] = tmp;
+		}
 }
 
-static void test_perf_memory_rmw(void)
+static void test_perf(void)
 {
-	u32 cyc, tmp;
+	u32 runs = cmdline_u32("runs", 3);
+	u32 threshold = cmdline_u32("threshold", 3);
+	u32 samples[PERF_MAX_RUNS], baseline, cyc;
+	u32 class_sum[NR_PERF_CLASSES] = { 0 };
+	u32 class_nr[NR_PERF_CLASSES] = { 0 };
+	struct perf_insn *p;
+	int i, r;
+
+	if (runs < 1)
+		runs = 1;
+	if (runs > PERF_MAX_RUNS)
+		runs = PERF_MAX_RUNS;
+
+	*(u32 *)(0x11 * 4) = 0x1000; /* int $0x11 goes to an IRET, as in test_int() */
+	*(u8 *)(0x1000) = 0xcf;
+
+	/*
+	 * Every iteration of the driver is one emulated "loop"; the
+	 * entries below are measured on top of it.
+	 */
+	for (r = 0; r < runs; ++r)
+		samples[r] = cycles_in_big_real_mode(&insn_perf_loop);
+	sort_u32(samples, runs);
+	baseline = samples[runs / 2];
+	print_serial_u32(baseline);
+	print_serial(" cycles/emulated jump instruction\n");
+
+	print_serial_w("instruction", 16);
+	print_serial("     min  median     max  cycles/insn, ");
+	print_serial_u32(runs);
+	print_serial(" runs\n");
+	for (i = 0; i < sizeof(perf_insns) / sizeof(perf_insns[0]); ++i) {
+		p = &perf_insns[i];
+		for (r = 0; r < runs; ++r) {
+			cyc = cycles_in_big_real_mode(p->insn);
+			samples[r] = cyc > baseline ?
+				(cyc - baseline) / p->insns : 0;
+		}
+		sort_u32(samples, runs);
+		print_serial_w(p->name, 16);
+		print_serial_u32_w(samples[0], 8);
+		print_serial_u32_w(samples[runs / 2], 8);
+		print_serial_u32_w(samples[runs - 1], 8);
+		print_serial("\n");
+		class_sum[p->class] += samples[runs / 2];
+		class_nr[p->class]++;
+	}
 
-	MK_INSN_PERF(perf_memory_rmw, "add $1, (%edi)");
-	inregs.edi = (u32)&tmp;
-	cyc = cycles_in_big_real_mode(&insn_perf_memory_rmw);
-	print_serial_u32((cyc - perf_baseline) / PERF_COUNT);
-	print_serial(" cycles/emulated memory RMW instruction\n");
+	print_serial("class averages, slow = over ");
+	print_serial_u32(threshold);
+	print_serial("x the emulated jump\n");
+	for (i = 0; i < NR_PERF_CLASSES; ++i) {
+		cyc = class_sum[i] / class_nr[i];
+		print_serial_w(perf_class_names[i], 16);
+		print_serial_u32_w(cyc, 8);
+		print_serial(cyc > threshold * baseline ? "  slow\n" : "\n");
+	}
 }
 
 void test_dr_mod(void)
@@ -1722,12 +1867,7 @@ void realmode_start(void)
 	test_smsw();
 	test_nopl();
 	test_xadd();
-	test_perf_loop();
-	test_perf_mov();
-	test_perf_arith();
-	test_perf_memory_load();
-	test_perf_memory_store();
-	test_perf_memory_rmw();
+	test_perf();
 
 	exit(failed);
 }
@@ -1757,6 +1897,18 @@ asm(
 
 	".text \n\t"
 	"start: \n\t"
+	/* copy the multiboot command line, if any, below 64K */
+	"testl $4, (%ebx) \n\t"
+	"jz 2f \n\t"
+	"cld \n\t"
+	"mov 16(%ebx), %esi \n\t"
+	"mov $cmdline, %edi \n\t"
+	"mov $255, %ecx \n\t"
+	"1: lodsb \n\t"
+	"stosb \n\t"
+	"test %al, %al \n\t"
+	"loopnz 1b \n\t"
+	"2: \n\t"
 	"lgdt r_gdt_descr \n\t"
 	"ljmp $8, $1f; 1: \n\t"
 	".code16gcc \n\t"
@@ -20,10 +20,11 @@
  *	can be added to "vmx_tests", see details of "struct vmx_test"
  *	and function test_run().
  *
- * Currently, vmx test framework only set up one VCPU and one
- * concurrent guest test environment with same paging for L2 and
- * L1. For usage of EPT, only 1:1 mapped paging is used from VFN
- * to PFN.
+ * Each CPU has its own framework state (struct vmx_cpu), so
+ * test_run_smp() can run the L2 guest of a test on several CPUs
+ * at once; test_run() runs it on the current CPU only. L2 uses
+ * the same paging as L1. For usage of EPT, only 1:1 mapped paging
+ * is used from VFN to PFN.
  *
  * Author : Arthur Chunqi Li <yzt356@gmail.com>
  */
@@ -37,16 +38,11 @@
 #include "smp.h"
 #include "io.h"
 
-u64 *vmxon_region;
-struct vmcs *vmcs_root;
+#define VMX_MAX_CPUS	64	/* max_cpus in cstart64.S */
+
+static struct vmx_cpu vmx_cpus[VMX_MAX_CPUS];
 u32 vpid_cnt;
-void *guest_stack, *guest_syscall_stack;
 u32 ctrl_pin, ctrl_enter, ctrl_exit, ctrl_cpu[2];
-struct regs regs;
-struct vmx_test *current;
-u64 hypercall_field;
-bool launched;
-u64 host_rflags;
 
 union vmx_basic basic;
 union vmx_ctrl_msr ctrl_pin_rev;
@@ -62,12 +58,10 @@ extern void *vmx_return;
 extern void *entry_sysenter;
 extern void *guest_entry;
 
-static volatile u32 stage;
-
 void vmx_set_test_stage(u32 s)
 {
 	barrier();
-	stage = s;
+	this_vmx_cpu()->stage = s;
 	barrier();
 }
 
@@ -76,7 +70,7 @@ u32 vmx_get_test_stage(void)
 	u32 s;
 
 	barrier();
-	s = stage;
+	s = this_vmx_cpu()->stage;
 	barrier();
 	return s;
 }
@@ -84,7 +78,7 @@ u32 vmx_get_test_stage(void)
 void vmx_inc_test_stage(void)
 {
 	barrier();
-	stage++;
+	this_vmx_cpu()->stage++;
 	barrier();
 }
 
@@ -113,6 +107,8 @@ asm(
 
 static void __attribute__((__used__)) syscall_handler(u64 syscall_no)
 {
+	struct vmx_test *current = this_vmx_cpu()->current;
+
 	if (current->syscall_handler)
 		current->syscall_handler(syscall_no);
 }
@@ -121,8 +117,10 @@ static inline int vmx_on()
 {
 	bool ret;
 	u64 rflags = read_rflags() | X86_EFLAGS_CF | X86_EFLAGS_ZF;
+	u64 **vmxon_region = &this_vmx_cpu()->vmxon_region;
+
 	asm volatile ("push %1; popf; vmxon %2; setbe %0\n\t"
-		      : "=q" (ret) : "q" (rflags), "m" (vmxon_region) : "cc");
+		      : "=q" (ret) : "q" (rflags), "m" (*vmxon_region) : "cc");
 	return ret;
 }
 
@@ -139,6 +137,7 @@ static inline int vmx_off()
 void print_vmexit_info()
 {
 	u64 guest_rip, guest_rsp;
+	struct regs *regs = &this_vmx_cpu()->regs;
 	ulong reason = vmcs_read(EXI_REASON) & 0xff;
 	ulong exit_qual = vmcs_read(EXI_QUALIFICATION);
 	guest_rip = vmcs_read(GUEST_RIP);
@@ -149,18 +148,18 @@ void print_vmexit_info()
 	printf("\tBit 31 of reason = %x\n", (vmcs_read(EXI_REASON) >> 31) & 1);
 	printf("\tguest_rip = 0x%llx\n", guest_rip);
 	printf("\tRAX=0x%llx    RBX=0x%llx    RCX=0x%llx    RDX=0x%llx\n",
-		regs.rax, regs.rbx, regs.rcx, regs.rdx);
+		regs->rax, regs->rbx, regs->rcx, regs->rdx);
 	printf("\tRSP=0x%llx    RBP=0x%llx    RSI=0x%llx    RDI=0x%llx\n",
-		guest_rsp, regs.rbp, regs.rsi, regs.rdi);
+		guest_rsp, regs->rbp, regs->rsi, regs->rdi);
 	printf("\tR8 =0x%llx    R9 =0x%llx    R10=0x%llx    R11=0x%llx\n",
-		regs.r8, regs.r9, regs.r10, regs.r11);
+		regs->r8, regs->r9, regs->r10, regs->r11);
 	printf("\tR12=0x%llx    R13=0x%llx    R14=0x%llx    R15=0x%llx\n",
-		regs.r12, regs.r13, regs.r14, regs.r15);
+		regs->r12, regs->r13, regs->r14, regs->r15);
 }
 
 static void test_vmclear(void)
 {
-	struct vmcs *tmp_root;
+	struct vmcs *tmp_root, *vmcs_root = this_vmx_cpu()->vmcs_root;
 	int width = cpuid_maxphyaddr();
 
 	/*
@@ -182,7 +181,7 @@ static void test_vmclear(void)
 	       vmcs_clear(tmp_root) == 1);
 
 	/* Pass VMXON region */
-	tmp_root = (struct vmcs *)vmxon_region;
+	tmp_root = (struct vmcs *)this_vmx_cpu()->vmxon_region;
 	report("test vmclear with vmxon region",
 	       vmcs_clear(tmp_root) == 1);
 
@@ -201,7 +200,7 @@ static void test_vmxoff(void)
 
 static void __attribute__((__used__)) guest_main(void)
 {
-	current->guest_main();
+	this_vmx_cpu()->current->guest_main();
 }
 
 /* guest_entry */
@@ -282,6 +281,52 @@ void install_2m_ept(unsigned long *pml4,
 			(phys & PAGE_MASK) | perm | EPT_LARGE_PAGE, 0);
 }
 
+/* fill_ept_table : Map [@phys, @max) 1:1 starting at @pt, a table of
+		@level, descending into (and allocating) lower tables
+		only where a large page does not fit.  Every table is
+		filled in one pass instead of walking from the root for
+		each page.  Returns the first address not mapped.
+ */
+static u64 fill_ept_table(unsigned long *pt, int level, u64 phys, u64 max,
+			  int map_1g, int map_2m, u64 perm)
+{
+	int shift = (level - 1) * EPT_PGDIR_WIDTH + 12;
+	u64 size = 1ull << shift;
+	unsigned offset = (phys >> shift) & EPT_PGDIR_MASK;
+	unsigned long *next;
+	int large;
+
+	for (; offset <= EPT_PGDIR_MASK && phys + PAGE_SIZE <= max; offset++) {
+		large = (level == 3 && map_1g) || (level == 2 && map_2m);
+		if (level == 1 ||
+		    (large && !(phys & (size - 1)) && phys + size <= max)) {
+			pt[offset] = phys | perm | (level > 1 ? EPT_LARGE_PAGE : 0);
+			phys += size;
+			continue;
+		}
+		if (!(pt[offset] & EPT_PRESENT)) {
+			next = alloc_page();
+			memset(next, 0, PAGE_SIZE);
+			pt[offset] = virt_to_phys(next) | EPT_RA | EPT_WA | EPT_EA;
+		} else if (pt[offset] & EPT_LARGE_PAGE) {
+			/* split it, keeping what it mapped around the range */
+			u64 pte = pt[offset], sub = size >> EPT_PGDIR_WIDTH;
+			int i;
+
+			next = alloc_page();
+			for (i = 0; i <= EPT_PGDIR_MASK; i++)
+				next[i] = (pte & ~(size - 1) & 0xffffffffff000ull)
+					+ i * sub + (pte & 0xfff) -
+					(level == 2 ? EPT_LARGE_PAGE : 0);
+			pt[offset] = virt_to_phys(next) | EPT_RA | EPT_WA | EPT_EA;
+		} else
+			next = phys_to_virt(pt[offset] & 0xffffffffff000ull);
+		phys = fill_ept_table(next, level - 1, phys, max,
+				      map_1g, map_2m, perm);
+	}
+	return phys;
+}
+
 /* setup_ept_range : Setup a range of 1:1 mapped page to EPT paging structure.
 		@start : start address of guest page
 		@len : length of address to be mapped
@@ -292,25 +337,8 @@ void install_2m_ept(unsigned long *pml4,
 void setup_ept_range(unsigned long *pml4, unsigned long start,
 		     unsigned long len, int map_1g, int map_2m, u64 perm)
 {
-	u64 phys = start;
-	u64 max = (u64)len + (u64)start;
-
-	if (map_1g) {
-		while (phys + PAGE_SIZE_1G <= max) {
-			install_1g_ept(pml4, phys, phys, perm);
-			phys += PAGE_SIZE_1G;
-		}
-	}
-	if (map_2m) {
-		while (phys + PAGE_SIZE_2M <= max) {
-			install_2m_ept(pml4, phys, phys, perm);
-			phys += PAGE_SIZE_2M;
-		}
-	}
-	while (phys + PAGE_SIZE <= max) {
-		install_ept(pml4, phys, phys, perm);
-		phys += PAGE_SIZE;
-	}
+	fill_ept_table(pml4, EPT_PAGE_LEVEL, start, (u64)len + (u64)start,
+		       map_1g, map_2m, perm);
 }
 
 /* get_ept_pte : Get the PTE of a given level in EPT,
@@ -411,13 +439,22 @@ static void init_vmcs_ctrl(void)
 	vmcs_write(PIN_CONTROLS, ctrl_pin);
 	/* Disable VMEXIT of IO instruction */
 	vmcs_write(CPU_EXEC_CTRL0, ctrl_cpu[0]);
-	if (ctrl_cpu_rev[0].set & CPU_SECONDARY) {
-		ctrl_cpu[1] = (ctrl_cpu[1] | ctrl_cpu_rev[1].set) &
-			ctrl_cpu_rev[1].clr;
+	if (ctrl_cpu_rev[0].set & CPU_SECONDARY)
 		vmcs_write(CPU_EXEC_CTRL1, ctrl_cpu[1]);
-	}
 	vmcs_write(CR3_TARGET_COUNT, 0);
-	vmcs_write(VPID, ++vpid_cnt);
+	vmcs_write(VPID, __sync_add_and_fetch(&vpid_cnt, 1));
+}
+
+/* Base of the TSS that TR selects; every CPU has its own */
+static u64 tr_base(void)
+{
+	struct descriptor_table_ptr gdt;
+	u8 *desc;
+
+	sgdt(&gdt);
+	desc = (u8 *)gdt.base + (str() & ~7);
+	return desc[2] | desc[3] << 8 | desc[4] << 16 | (u64)desc[7] << 24 |
+	       (u64)*(u32 *)(desc + 8) << 32;
 }
 
 static void init_vmcs_host(void)
@@ -444,12 +481,13 @@ static void init_vmcs_host(void)
 	vmcs_write(HOST_SEL_ES, KERNEL_DS);
 	vmcs_write(HOST_SEL_FS, KERNEL_DS);
 	vmcs_write(HOST_SEL_GS, KERNEL_DS);
-	vmcs_write(HOST_SEL_TR, TSS_MAIN);
-	vmcs_write(HOST_BASE_TR, tss_descr.base);
+	vmcs_write(HOST_SEL_TR, str());
+	vmcs_write(HOST_BASE_TR, tr_base());
 	vmcs_write(HOST_BASE_GDTR, gdt64_desc.base);
 	vmcs_write(HOST_BASE_IDTR, idt_descr.base);
 	vmcs_write(HOST_BASE_FS, 0);
-	vmcs_write(HOST_BASE_GS, 0);
+	/* the per-CPU area, see struct vmx_cpu */
+	vmcs_write(HOST_BASE_GS, rdmsr(MSR_GS_BASE));
 
 	/* Set other vmcs area */
 	vmcs_write(PF_ERROR_MASK, 0);
@@ -463,6 +501,7 @@ static void init_vmcs_guest(void)
 {
 	/* 26.3 CHECKING AND LOADING GUEST STATE */
 	ulong guest_cr0, guest_cr4, guest_cr3;
+	struct vmx_cpu *cpu = this_vmx_cpu();
 	/* 26.3.1.1 */
 	guest_cr0 = read_cr0();
 	guest_cr4 = read_cr4();
@@ -480,7 +519,7 @@ static void init_vmcs_guest(void)
 	vmcs_write(GUEST_CR4, guest_cr4);
 	vmcs_write(GUEST_SYSENTER_CS,  KERNEL_CS);
 	vmcs_write(GUEST_SYSENTER_ESP,
-		(u64)(guest_syscall_stack + PAGE_SIZE - 1));
+		(u64)(cpu->guest_syscall_stack + PAGE_SIZE - 1));
 	vmcs_write(GUEST_SYSENTER_EIP, (u64)(&entry_sysenter));
 	vmcs_write(GUEST_DR7, 0);
 	vmcs_write(GUEST_EFER, rdmsr(MSR_EFER));
@@ -492,7 +531,7 @@ static void init_vmcs_guest(void)
 	vmcs_write(GUEST_SEL_ES, KERNEL_DS);
 	vmcs_write(GUEST_SEL_FS, KERNEL_DS);
 	vmcs_write(GUEST_SEL_GS, KERNEL_DS);
-	vmcs_write(GUEST_SEL_TR, TSS_MAIN);
+	vmcs_write(GUEST_SEL_TR, str());
 	vmcs_write(GUEST_SEL_LDTR, 0);
 
 	vmcs_write(GUEST_BASE_CS, 0);
@@ -500,8 +539,8 @@ static void init_vmcs_guest(void)
 	vmcs_write(GUEST_BASE_SS, 0);
 	vmcs_write(GUEST_BASE_DS, 0);
 	vmcs_write(GUEST_BASE_FS, 0);
-	vmcs_write(GUEST_BASE_GS, 0);
-	vmcs_write(GUEST_BASE_TR, tss_descr.base);
+	vmcs_write(GUEST_BASE_GS, rdmsr(MSR_GS_BASE));
+	vmcs_write(GUEST_BASE_TR, tr_base());
 	vmcs_write(GUEST_BASE_LDTR, 0);
 
 	vmcs_write(GUEST_LIMIT_CS, 0xFFFFFFFF);
@@ -530,7 +569,7 @@ static void init_vmcs_guest(void)
 
 	/* 26.3.1.4 */
 	vmcs_write(GUEST_RIP, (u64)(&guest_entry));
-	vmcs_write(GUEST_RSP, (u64)(guest_stack + PAGE_SIZE - 1));
+	vmcs_write(GUEST_RSP, (u64)(cpu->guest_stack + PAGE_SIZE - 1));
 	vmcs_write(GUEST_RFLAGS, 0x2);
 
 	/* 26.3.1.5 */
@@ -540,7 +579,8 @@ static void init_vmcs_guest(void)
 
 static int init_vmcs(struct vmcs **vmcs)
 {
-	*vmcs = alloc_page();
+	if (!*vmcs)
+		*vmcs = alloc_page();
 	memset(*vmcs, 0, PAGE_SIZE);
 	(*vmcs)->revision_id = basic.revision;
 	/* vmclear first to init vmcs */
@@ -554,38 +594,41 @@ static int init_vmcs(struct vmcs **vmcs)
 		return 1;
 	}
 
-	/* All settings to pin/exit/enter/cpu
-	   control fields should be placed here */
-	ctrl_pin |= PIN_EXTINT | PIN_NMI | PIN_VIRT_NMI;
-	ctrl_exit = EXI_LOAD_EFER | EXI_HOST_64;
-	ctrl_enter = (ENT_LOAD_EFER | ENT_GUEST_64);
-	/* DIsable IO instruction VMEXIT now */
-	ctrl_cpu[0] &= (~(CPU_IO | CPU_IO_BITMAP));
-	ctrl_cpu[1] = 0;
-
-	ctrl_pin = (ctrl_pin | ctrl_pin_rev.set) & ctrl_pin_rev.clr;
-	ctrl_enter = (ctrl_enter | ctrl_enter_rev.set) & ctrl_enter_rev.clr;
-	ctrl_exit = (ctrl_exit | ctrl_exit_rev.set) & ctrl_exit_rev.clr;
-	ctrl_cpu[0] = (ctrl_cpu[0] | ctrl_cpu_rev[0].set) & ctrl_cpu_rev[0].clr;
-
 	init_vmcs_ctrl();
 	init_vmcs_host();
 	init_vmcs_guest();
 	return 0;
 }
 
-static void init_vmx(void)
+/* Point %gs:8 at @data, this CPU's vmx_cpu, and turn VMX on in CR4 */
+static void init_vmx_cpu(void *data)
 {
 	ulong fix_cr0_set, fix_cr0_clr;
 	ulong fix_cr4_set, fix_cr4_clr;
 
-	vmxon_region = alloc_page();
-	memset(vmxon_region, 0, PAGE_SIZE);
+	asm volatile("mov %0, %%gs:8" : : "r"(data) : "memory");
 
 	fix_cr0_set =  rdmsr(MSR_IA32_VMX_CR0_FIXED0);
 	fix_cr0_clr =  rdmsr(MSR_IA32_VMX_CR0_FIXED1);
 	fix_cr4_set =  rdmsr(MSR_IA32_VMX_CR4_FIXED0);
 	fix_cr4_clr = rdmsr(MSR_IA32_VMX_CR4_FIXED1);
+	write_cr0((read_cr0() & fix_cr0_clr) | fix_cr0_set);
+	write_cr4((read_cr4() & fix_cr4_clr) | fix_cr4_set | X86_CR4_VMXE);
+}
+
+/* The BSP's FEATURE_CONTROL is left to test_vmx_feature_control() */
+static void init_vmx_ap(void *data)
+{
+	if (!(rdmsr(MSR_IA32_FEATURE_CONTROL) & 0x1))
+		wrmsr(MSR_IA32_FEATURE_CONTROL, 0x5);
+	init_vmx_cpu(data);
+}
+
+static void init_vmx(void)
+{
+	struct vmx_cpu *cpu;
+	int i;
+
 	basic.val = rdmsr(MSR_IA32_VMX_BASIC);
 	ctrl_pin_rev.val = rdmsr(basic.ctrl ? MSR_IA32_VMX_TRUE_PIN
 			: MSR_IA32_VMX_PINBASED_CTLS);
@@ -604,15 +647,38 @@ static void init_vmx(void)
 	else
 		ept_vpid.val = 0;
 
-	write_cr0((read_cr0() & fix_cr0_clr) | fix_cr0_set);
-	write_cr4((read_cr4() & fix_cr4_clr) | fix_cr4_set | X86_CR4_VMXE);
+	/* All settings to pin/exit/enter/cpu
+	   control fields should be placed here */
+	ctrl_pin = PIN_EXTINT | PIN_NMI | PIN_VIRT_NMI;
+	ctrl_exit = EXI_LOAD_EFER | EXI_HOST_64;
+	ctrl_enter = (ENT_LOAD_EFER | ENT_GUEST_64);
+	/* DIsable IO instruction VMEXIT now */
+	ctrl_cpu[0] = 0;
+	ctrl_cpu[1] = 0;
 
-	*vmxon_region = basic.revision;
+	ctrl_pin = (ctrl_pin | ctrl_pin_rev.set) & ctrl_pin_rev.clr;
+	ctrl_enter = (ctrl_enter | ctrl_enter_rev.set) & ctrl_enter_rev.clr;
+	ctrl_exit = (ctrl_exit | ctrl_exit_rev.set) & ctrl_exit_rev.clr;
+	ctrl_cpu[0] = (ctrl_cpu[0] | ctrl_cpu_rev[0].set) & ctrl_cpu_rev[0].clr;
+	ctrl_cpu[1] = (ctrl_cpu[1] | ctrl_cpu_rev[1].set) & ctrl_cpu_rev[1].clr;
+
+	/* alloc_page() is not SMP safe, allocate for every CPU here */
+	for (i = 0; i < cpu_count() && i < VMX_MAX_CPUS; i++) {
+		cpu = &vmx_cpus[i];
+		cpu->index = i;
+		cpu->vmxon_region = alloc_page();
+		memset(cpu->vmxon_region, 0, PAGE_SIZE);
+		*cpu->vmxon_region = basic.revision;
+		cpu->vmcs_root = alloc_page();
+		cpu->guest_stack = alloc_page();
+		memset(cpu->guest_stack, 0, PAGE_SIZE);
+		cpu->guest_syscall_stack = alloc_page();
+		memset(cpu->guest_syscall_stack, 0, PAGE_SIZE);
+	}
 
-	guest_stack = alloc_page();
-	memset(guest_stack, 0, PAGE_SIZE);
-	guest_syscall_stack = alloc_page();
-	memset(guest_syscall_stack, 0, PAGE_SIZE);
+	init_vmx_cpu(&vmx_cpus[0]);
+	for (i = 1; i < cpu_count() && i < VMX_MAX_CPUS; i++)
+		on_cpu(i, init_vmx_ap, &vmx_cpus[i]);
 }
 
 static void do_vmxon_off(void *data)
@@ -662,11 +728,12 @@ static int test_vmx_feature_control(void)
 static int test_vmxon(void)
 {
 	int ret, ret1;
-	u64 *tmp_region = vmxon_region;
+	u64 **vmxon_region = &this_vmx_cpu()->vmxon_region;
+	u64 *tmp_region = *vmxon_region;
 	int width = cpuid_maxphyaddr();
 
 	/* Unaligned page access */
-	vmxon_region = (u64 *)((intptr_t)vmxon_region + 1);
+	*vmxon_region = (u64 *)((intptr_t)tmp_region + 1);
 	ret1 = vmx_on();
 	report("test vmxon with unaligned vmxon region", ret1);
 	if (!ret1) {
@@ -675,7 +742,7 @@ static int test_vmxon(void)
 	}
 
 	/* gpa bits beyond physical address width are set*/
-	vmxon_region = (u64 *)((intptr_t)tmp_region | ((u64)1 << (width+1)));
+	*vmxon_region = (u64 *)((intptr_t)tmp_region | ((u64)1 << (width+1)));
 	ret1 = vmx_on();
 	report("test vmxon with bits set beyond physical address width", ret1);
 	if (!ret1) {
@@ -684,8 +751,8 @@ static int test_vmxon(void)
 	}
 
 	/* invalid revision indentifier */
-	vmxon_region = tmp_region;
-	*vmxon_region = 0xba9da9;
+	*vmxon_region = tmp_region;
+	**vmxon_region = 0xba9da9;
 	ret1 = vmx_on();
 	report("test vmxon with invalid revision identifier", ret1);
 	if (!ret1) {
@@ -694,7 +761,7 @@ static int test_vmxon(void)
 	}
 
 	/* and finally a valid region */
-	*vmxon_region = basic.revision;
+	**vmxon_region = basic.revision;
 	ret = vmx_on();
 	report("test vmxon with valid vmxon region", !ret);
 
@@ -722,7 +789,7 @@ static void test_vmptrld(void)
 	       make_vmcs_current(tmp_root) == 1);
 
 	/* Pass VMXON region */
-	tmp_root = (struct vmcs *)vmxon_region;
+	tmp_root = (struct vmcs *)this_vmx_cpu()->vmxon_region;
 	report("test vmptrld with vmxon region",
 	       make_vmcs_current(tmp_root) == 1);
 
@@ -817,7 +884,7 @@ static void __attribute__((__used__)) hypercall(u32 hypercall_no)
 {
 	u64 val = 0;
 	val = (hypercall_no & HYPERCALL_MASK) | HYPERCALL_BIT;
-	hypercall_field = val;
+	this_vmx_cpu()->hypercall_field = val;
 	asm volatile("vmcall\n\t");
 }
 
@@ -826,7 +893,7 @@ static bool is_hypercall()
 	ulong reason, hyper_bit;
 
 	reason = vmcs_read(EXI_REASON) & 0xff;
-	hyper_bit = hypercall_field & HYPERCALL_BIT;
+	hyper_bit = this_vmx_cpu()->hypercall_field & HYPERCALL_BIT;
 	if (reason == VMX_VMCALL && hyper_bit)
 		return true;
 	return false;
@@ -834,10 +901,11 @@ static bool is_hypercall()
 
 static int handle_hypercall()
 {
+	struct vmx_cpu *cpu = this_vmx_cpu();
 	ulong hypercall_no;
 
-	hypercall_no = hypercall_field & HYPERCALL_MASK;
-	hypercall_field = 0;
+	hypercall_no = cpu->hypercall_field & HYPERCALL_MASK;
+	cpu->hypercall_field = 0;
 	switch (hypercall_no) {
 	case HYPERCALL_VMEXIT:
 		return VMX_TEST_VMEXIT;
@@ -849,15 +917,16 @@ static int handle_hypercall()
 
 static int exit_handler()
 {
+	struct vmx_cpu *cpu = this_vmx_cpu();
 	int ret;
 
-	current->exits++;
-	regs.rflags = vmcs_read(GUEST_RFLAGS);
+	cpu->exits++;
+	cpu->regs.rflags = vmcs_read(GUEST_RFLAGS);
 	if (is_hypercall())
 		ret = handle_hypercall();
 	else
-		ret = current->exit_handler();
-	vmcs_write(GUEST_RFLAGS, regs.rflags);
+		ret = cpu->current->exit_handler();
+	vmcs_write(GUEST_RFLAGS, cpu->regs.rflags);
 	switch (ret) {
 	case VMX_TEST_VMEXIT:
 	case VMX_TEST_RESUME:
@@ -875,16 +944,18 @@ static int exit_handler()
 
 static int vmx_run()
 {
+	struct vmx_cpu *cpu = this_vmx_cpu();
 	u32 ret = 0, fail = 0;
 
 	while (1) {
+		/* test launched before the GPRs (and %1's base) are L2's */
 		asm volatile (
 			"mov %%rsp, %%rsi\n\t"
 			"mov %2, %%rdi\n\t"
 			"vmwrite %%rsi, %%rdi\n\t"
 
+			"cmpb $0, %1\n\t"
 			LOAD_GPR_C
-			"cmpl $0, %1\n\t"
 			"jne 1f\n\t"
 			LOAD_RFLAGS
 			"vmlaunch\n\t"
@@ -897,35 +968,35 @@ static int vmx_run()
 			SAVE_GPR_C
 			SAVE_RFLAGS
 			: "=m"(fail)
-			: "m"(launched), "i"(HOST_RSP)
+			: "m"(cpu->launched), "i"(HOST_RSP)
 			: "rdi", "rsi", "memory", "cc"
 
 		);
 		if (fail)
-			ret = launched ? VMX_TEST_RESUME_ERR :
+			ret = cpu->launched ? VMX_TEST_RESUME_ERR :
 				VMX_TEST_LAUNCH_ERR;
 		else {
-			launched = 1;
+			cpu->launched = 1;
 			ret = exit_handler();
 		}
 		if (ret != VMX_TEST_RESUME)
 			break;
 	}
-	launched = 0;
+	cpu->launched = 0;
 	switch (ret) {
 	case VMX_TEST_VMEXIT:
 		return 0;
 	case VMX_TEST_LAUNCH_ERR:
 		printf("%s : vmlaunch failed.\n", __func__);
-		if ((!(host_rflags & X86_EFLAGS_CF) && !(host_rflags & X86_EFLAGS_ZF))
-			|| ((host_rflags & X86_EFLAGS_CF) && (host_rflags & X86_EFLAGS_ZF)))
+		if ((!(cpu->host_rflags & X86_EFLAGS_CF) && !(cpu->host_rflags & X86_EFLAGS_ZF))
+			|| ((cpu->host_rflags & X86_EFLAGS_CF) && (cpu->host_rflags & X86_EFLAGS_ZF)))
 			printf("\tvmlaunch set wrong flags\n");
 		report("test vmlaunch", 0);
 		break;
 	case VMX_TEST_RESUME_ERR:
 		printf("%s : vmresume failed.\n", __func__);
-		if ((!(host_rflags & X86_EFLAGS_CF) && !(host_rflags & X86_EFLAGS_ZF))
-			|| ((host_rflags & X86_EFLAGS_CF) && (host_rflags & X86_EFLAGS_ZF)))
+		if ((!(cpu->host_rflags & X86_EFLAGS_CF) && !(cpu->host_rflags & X86_EFLAGS_ZF))
+			|| ((cpu->host_rflags & X86_EFLAGS_CF) && (cpu->host_rflags & X86_EFLAGS_ZF)))
 			printf("\tvmresume set wrong flags\n");
 		report("test vmresume", 0);
 		break;
@@ -938,6 +1009,8 @@ static int vmx_run()
 
 static int test_run(struct vmx_test *test)
 {
+	struct vmx_cpu *cpu = this_vmx_cpu();
+
 	if (test->name == NULL)
 		test->name = "(no name)";
 	if (vmx_on()) {
@@ -949,13 +1022,14 @@ static int test_run(struct vmx_test *test)
 	   vmcs init, vmclear and vmptrld*/
 	if (test->init && test->init(test->vmcs) != VMX_TEST_START)
 		goto out;
-	test->exits = 0;
-	current = test;
-	regs = test->guest_regs;
-	vmcs_write(GUEST_RFLAGS, regs.rflags | 0x2);
-	launched = 0;
+	cpu->exits = 0;
+	cpu->current = test;
+	cpu->regs = test->guest_regs;
+	vmcs_write(GUEST_RFLAGS, cpu->regs.rflags | 0x2);
+	cpu->launched = 0;
 	printf("\nTest suite: %s\n", test->name);
 	vmx_run();
+	test->exits = cpu->exits;
 out:
 	if (vmx_off()) {
 		printf("%s : vmxoff failed.\n", __func__);
@@ -964,15 +1038,72 @@ out:
 	return 0;
 }
 
+static void test_run_cpu(void *data)
+{
+	struct vmx_test *test = data;
+	struct vmx_cpu *cpu = this_vmx_cpu();
+
+	cpu->failed = vmx_on();
+	if (cpu->failed)
+		goto done;
+	init_vmcs(&cpu->vmcs_root);
+	if (!test->init || test->init(cpu->vmcs_root) == VMX_TEST_START) {
+		cpu->exits = 0;
+		cpu->current = test;
+		cpu->regs = test->guest_regs;
+		vmcs_write(GUEST_RFLAGS, cpu->regs.rflags | 0x2);
+		cpu->launched = 0;
+		cpu->failed = vmx_run();
+	}
+	cpu->failed |= vmx_off();
+done:
+	barrier();
+	cpu->done = true;
+}
+
+/*
+ * test_run_smp : Run @test on CPUs 0 to @ncpus - 1 at once, each with
+ *	its own VMCS, L2 stack and vmx_cpu.  init and exit_handler run
+ *	concurrently on every CPU and must not allocate memory.  Unlike
+ *	test_run() nothing is printed; test->exits is the total.
+ */
+int test_run_smp(struct vmx_test *test, int ncpus)
+{
+	int i, failed = 0;
+
+	if (ncpus < 1 || ncpus > cpu_count() || ncpus > VMX_MAX_CPUS) {
+		printf("%s : cannot run on %d CPUs.\n", __func__, ncpus);
+		return 1;
+	}
+	for (i = 0; i < ncpus; i++)
+		vmx_cpus[i].done = false;
+	for (i = 1; i < ncpus; i++)
+		on_cpu_async(i, test_run_cpu, test);
+	test_run_cpu(test);
+
+	test->exits = 0;
+	for (i = 0; i < ncpus; i++) {
+		while (!vmx_cpus[i].done)
+			pause();
+		if (vmx_cpus[i].failed)
+			printf("%s : CPU %d failed.\n", __func__, i);
+		failed |= vmx_cpus[i].failed;
+		test->exits += vmx_cpus[i].exits;
+	}
+	return failed;
+}
+
 extern struct vmx_test vmx_tests[];
+extern struct vmx_test vmx_bench_tests[];
+extern void vmx_bench_smp(void);
 
-int main(void)
+int main(int ac, char **av)
 {
 	int i = 0;
 
+	smp_init();
 	setup_vm();
 	setup_idt();
-	hypercall_field = 0;
 
 	if (!(cpuid(1).c & (1 << 5))) {
 		printf("WARNING: vmx not supported, add '-cpu host'\n");
@@ -982,13 +1113,20 @@ int main(void)
 	if (test_vmx_feature_control() != 0)
 		goto exit;
 	/* Set basic test ctxt the same as "null" */
-	current = &vmx_tests[0];
+	this_vmx_cpu()->current = &vmx_tests[0];
+	if (ac > 1 && strcmp(av[1], "bench") == 0) {
+		for (i = 0; vmx_bench_tests[i].name != NULL; i++)
+			if (test_run(&vmx_bench_tests[i]))
+				goto exit;
+		vmx_bench_smp();
+		goto exit;
+	}
 	if (test_vmxon() != 0)
 		goto exit;
 	test_vmptrld();
 	test_vmclear();
 	test_vmptrst();
-	init_vmcs(&vmcs_root);
+	init_vmcs(&this_vmx_cpu()->vmcs_root);
 	if (vmx_run()) {
 		report("test vmlaunch", 0);
 		goto exit;
@@ -42,6 +42,26 @@ struct vmx_test {
 	int exits;
 };
 
+/*
+ * Framework state of one CPU, so that each CPU can run an L2 guest of its
+ * own at the same time.  %gs:8 points at the running CPU's, in L1 and L2.
+ */
+struct vmx_cpu {
+	struct regs regs;	/* must be first, see SAVE_GPR */
+	u64 host_rflags;	/* must follow regs, see SAVE_RFLAGS */
+	int index;		/* in vmx_cpus[]; APIC IDs need not be dense */
+	u64 *vmxon_region;
+	struct vmcs *vmcs_root;
+	void *guest_stack, *guest_syscall_stack;
+	struct vmx_test *current;
+	u64 hypercall_field;
+	bool launched;
+	u32 stage;
+	int exits;
+	bool failed;
+	volatile bool done;
+};
+
 union vmx_basic {
 	u64 val;
 	struct {
@@ -357,51 +377,75 @@ enum Ctrl1 {
 	CPU_RDRAND		= 1ul << 11,
 };
 
+/*
+ * The guest GPRs live in the running CPU's struct vmx_cpu, which %gs:8
+ * points at; %gs:16 holds the guest %rax while %rax is the base.  Like
+ * the xchg's themselves, the sequence is its own inverse.
+ */
 #define SAVE_GPR				\
-	"xchg %rax, regs\n\t"			\
-	"xchg %rbx, regs+0x8\n\t"		\
-	"xchg %rcx, regs+0x10\n\t"		\
-	"xchg %rdx, regs+0x18\n\t"		\
-	"xchg %rbp, regs+0x28\n\t"		\
-	"xchg %rsi, regs+0x30\n\t"		\
-	"xchg %rdi, regs+0x38\n\t"		\
-	"xchg %r8, regs+0x40\n\t"		\
-	"xchg %r9, regs+0x48\n\t"		\
-	"xchg %r10, regs+0x50\n\t"		\
-	"xchg %r11, regs+0x58\n\t"		\
-	"xchg %r12, regs+0x60\n\t"		\
-	"xchg %r13, regs+0x68\n\t"		\
-	"xchg %r14, regs+0x70\n\t"		\
-	"xchg %r15, regs+0x78\n\t"
+	"xchg %rax, %gs:16\n\t"			\
+	"mov %gs:8, %rax\n\t"			\
+	"xchg %rbx, 0x8(%rax)\n\t"		\
+	"xchg %rcx, 0x10(%rax)\n\t"		\
+	"xchg %rdx, 0x18(%rax)\n\t"		\
+	"xchg %rbp, 0x28(%rax)\n\t"		\
+	"xchg %rsi, 0x30(%rax)\n\t"		\
+	"xchg %rdi, 0x38(%rax)\n\t"		\
+	"xchg %r8, 0x40(%rax)\n\t"		\
+	"xchg %r9, 0x48(%rax)\n\t"		\
+	"xchg %r10, 0x50(%rax)\n\t"		\
+	"xchg %r11, 0x58(%rax)\n\t"		\
+	"xchg %r12, 0x60(%rax)\n\t"		\
+	"xchg %r13, 0x68(%rax)\n\t"		\
+	"xchg %r14, 0x70(%rax)\n\t"		\
+	"xchg %r15, 0x78(%rax)\n\t"		\
+	"push %rbx\n\t"				\
+	"mov %gs:16, %rbx\n\t"			\
+	"xchg %rbx, (%rax)\n\t"			\
+	"mov %rbx, %rax\n\t"			\
+	"pop %rbx\n\t"
 
 #define LOAD_GPR	SAVE_GPR
 
 #define SAVE_GPR_C				\
-	"xchg %%rax, regs\n\t"			\
-	"xchg %%rbx, regs+0x8\n\t"		\
-	"xchg %%rcx, regs+0x10\n\t"		\
-	"xchg %%rdx, regs+0x18\n\t"		\
-	"xchg %%rbp, regs+0x28\n\t"		\
-	"xchg %%rsi, regs+0x30\n\t"		\
-	"xchg %%rdi, regs+0x38\n\t"		\
-	"xchg %%r8, regs+0x40\n\t"		\
-	"xchg %%r9, regs+0x48\n\t"		\
-	"xchg %%r10, regs+0x50\n\t"		\
-	"xchg %%r11, regs+0x58\n\t"		\
-	"xchg %%r12, regs+0x60\n\t"		\
-	"xchg %%r13, regs+0x68\n\t"		\
-	"xchg %%r14, regs+0x70\n\t"		\
-	"xchg %%r15, regs+0x78\n\t"
+	"xchg %%rax, %%gs:16\n\t"		\
+	"mov %%gs:8, %%rax\n\t"			\
+	"xchg %%rbx, 0x8(%%rax)\n\t"		\
+	"xchg %%rcx, 0x10(%%rax)\n\t"		\
+	"xchg %%rdx, 0x18(%%rax)\n\t"		\
+	"xchg %%rbp, 0x28(%%rax)\n\t"		\
+	"xchg %%rsi, 0x30(%%rax)\n\t"		\
+	"xchg %%rdi, 0x38(%%rax)\n\t"		\
+	"xchg %%r8, 0x40(%%rax)\n\t"		\
+	"xchg %%r9, 0x48(%%rax)\n\t"		\
+	"xchg %%r10, 0x50(%%rax)\n\t"		\
+	"xchg %%r11, 0x58(%%rax)\n\t"		\
+	"xchg %%r12, 0x60(%%rax)\n\t"		\
+	"xchg %%r13, 0x68(%%rax)\n\t"		\
+	"xchg %%r14, 0x70(%%rax)\n\t"		\
+	"xchg %%r15, 0x78(%%rax)\n\t"		\
+	"push %%rbx\n\t"			\
+	"mov %%gs:16, %%rbx\n\t"		\
+	"xchg %%rbx, (%%rax)\n\t"		\
+	"mov %%rbx, %%rax\n\t"			\
+	"pop %%rbx\n\t"
 
 #define LOAD_GPR_C	SAVE_GPR_C
 
+/* struct vmx_cpu.host_rflags is at 0x88 */
 #define SAVE_RFLAGS		\
+	"push %%rax\n\t"		\
+	"mov %%gs:8, %%rax\n\t"	\
 	"pushf\n\t"			\
-	"pop host_rflags\n\t"
+	"popq 0x88(%%rax)\n\t"	\
+	"pop %%rax\n\t"
 
 #define LOAD_RFLAGS		\
-	"push host_rflags\n\t"	\
-	"popf\n\t"
+	"push %%rax\n\t"		\
+	"mov %%gs:8, %%rax\n\t"	\
+	"pushq 0x88(%%rax)\n\t"	\
+	"popf\n\t"			\
+	"pop %%rax\n\t"
 
 #define VMX_IO_SIZE_MASK		0x7
 #define _VMX_IO_BYTE			0
@@ -491,7 +535,13 @@ enum Ctrl1 {
 #define ACTV_ACTIVE		0
 #define ACTV_HLT		1
 
-extern struct regs regs;
+static inline struct vmx_cpu *this_vmx_cpu(void)
+{
+	struct vmx_cpu *cpu;
+
+	asm("mov %%gs:8, %0" : "=r"(cpu));
+	return cpu;
+}
 
 extern union vmx_basic basic;
 extern union vmx_ctrl_msr ctrl_pin_rev;
@@ -558,6 +608,7 @@ static inline void invvpid(unsigned long type, u16 vpid, u64 gva)
 }
 
 void print_vmexit_info();
+int test_run_smp(struct vmx_test *test, int ncpus);
 void ept_sync(int type, u64 eptp);
 void vpid_sync(int type, u16 vpid);
 void install_ept_entry(unsigned long *pml4, int pte_level,
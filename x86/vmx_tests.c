@@ -12,6 +12,7 @@
 #include "isr.h"
 #include "apic.h"
 #include "types.h"
+#include "smp.h"
 
 u64 ia32_pat;
 u64 ia32_efer;
@@ -65,11 +66,11 @@ int vmenter_exit_handler()
 	reason = vmcs_read(EXI_REASON) & 0xff;
 	switch (reason) {
 	case VMX_VMCALL:
-		if (regs.rax != 0xABCD) {
+		if (this_vmx_cpu()->regs.rax != 0xABCD) {
 			report("test vmresume", 0);
 			return VMX_TEST_VMEXIT;
 		}
-		regs.rax = 0xFFFF;
+		this_vmx_cpu()->regs.rax = 0xFFFF;
 		vmcs_write(GUEST_RIP, guest_rip + 3);
 		return VMX_TEST_RESUME;
 	default:
@@ -1592,6 +1593,248 @@ static int vmmcall_exit_handler()
 	return VMX_TEST_VMEXIT;
 }
 
+/*
+ * EPT walk cost: L2 loads from working sets of growing size, with L1's
+ * own page tables (2M pages) and the RAM mapped by EPT with 4K, 2M or
+ * 1G pages.  A TLB entry covers the smaller of the two page sizes, so
+ * this shows how much of the 2D walk large EPT pages save.  The
+ * "invlpg" column flushes the page before every load so that each one
+ * takes a full walk.
+ */
+#define EPT_BENCH_BASE		(16ul << 20)
+#define EPT_BENCH_LOADS		(1 << 16)
+#define EPT_BENCH_STRIDE	2053	/* in pages; odd, so it visits all */
+
+enum { EPT_4K, EPT_2M, EPT_1G };
+
+static const char *ept_bench_names[] = { "4K", "2M", "1G" };
+static const unsigned long ept_bench_ws[] = {
+	1ul << 20, 4ul << 20, 16ul << 20, 64ul << 20, 256ul << 20,
+};
+
+static int ept_bench_sizes[3], nr_ept_bench;
+static u64 ept_bench_eptp[3];
+static unsigned long ept_bench_max_ws;
+
+static u64 ept_bench_build(unsigned long ram, int size)
+{
+	u64 perm = EPT_RA | EPT_WA | EPT_EA |
+		   (EPT_MEM_TYPE_WB << EPT_MEM_TYPE_SHIFT);
+	unsigned long align = size == EPT_1G ? PAGE_SIZE_1G :
+			      size == EPT_2M ? PAGE_SIZE_2M : PAGE_SIZE;
+	unsigned long *root = alloc_page();
+
+	memset(root, 0, PAGE_SIZE);
+	setup_ept_range(root, 0, (ram + align - 1) & ~(align - 1),
+			size == EPT_1G, size != EPT_4K, perm);
+	return (eptp & ~PAGE_MASK) | virt_to_phys(root);
+}
+
+static int ept_bench_init()
+{
+	unsigned long ram = fwcfg_get_u64(FW_CFG_RAM_SIZE), p;
+	unsigned long *scratch;
+	u32 ctrl_cpu[2];
+	u64 t0, t1, t2;
+	int i;
+
+	if (!(ctrl_cpu_rev[0].clr & CPU_SECONDARY) ||
+	    !(ctrl_cpu_rev[1].clr & CPU_EPT)) {
+		printf("\tEPT is not supported");
+		return VMX_TEST_EXIT;
+	}
+	for (i = 0; i < ARRAY_SIZE(ept_bench_ws); i++)
+		if (EPT_BENCH_BASE + ept_bench_ws[i] <= ram)
+			ept_bench_max_ws = ept_bench_ws[i];
+	if (!ept_bench_max_ws) {
+		printf("\tnot enough memory\n");
+		return VMX_TEST_EXIT;
+	}
+
+	/* L2 issues invlpg itself, don't exit on it */
+	ctrl_cpu[0] = (vmcs_read(CPU_EXEC_CTRL0) | CPU_SECONDARY) & ~CPU_INVLPG;
+	ctrl_cpu[0] = (ctrl_cpu[0] | ctrl_cpu_rev[0].set) & ctrl_cpu_rev[0].clr;
+	ctrl_cpu[1] = (vmcs_read(CPU_EXEC_CTRL1) | CPU_EPT) & ctrl_cpu_rev[1].clr;
+	vmcs_write(CPU_EXEC_CTRL0, ctrl_cpu[0]);
+	vmcs_write(CPU_EXEC_CTRL1, ctrl_cpu[1]);
+	if (setup_ept())
+		return VMX_TEST_EXIT;
+
+	scratch = alloc_page();
+	memset(scratch, 0, PAGE_SIZE);
+	t0 = rdtsc();
+	for (p = 0; p < ram; p += PAGE_SIZE)
+		install_ept(scratch, p, p, EPT_RA | EPT_WA | EPT_EA);
+	t1 = rdtsc();
+	ept_bench_eptp[0] = ept_bench_build(ram, EPT_4K);
+	t2 = rdtsc();
+	printf("EPT setup of %luM with 4K pages: install_ept %lu cycles, "
+	       "setup_ept_range %lu cycles\n", ram >> 20, t1 - t0, t2 - t1);
+
+	ept_bench_sizes[nr_ept_bench++] = EPT_4K;
+	if (ept_vpid.val & EPT_CAP_2M_PAGE) {
+		ept_bench_eptp[nr_ept_bench] = ept_bench_build(ram, EPT_2M);
+		ept_bench_sizes[nr_ept_bench++] = EPT_2M;
+	}
+	if (ept_vpid.val & EPT_CAP_1G_PAGE) {
+		ept_bench_eptp[nr_ept_bench] = ept_bench_build(ram, EPT_1G);
+		ept_bench_sizes[nr_ept_bench++] = EPT_1G;
+	}
+	vmcs_write(EPTP, ept_bench_eptp[0]);
+	vmx_set_test_stage(0);
+	return VMX_TEST_START;
+}
+
+/* Cycles per load, each one completing before the next is issued. */
+static u64 ept_bench_loads(unsigned long ws, bool flush)
+{
+	unsigned long n = ws / PAGE_SIZE, i;
+	char *base = (char *)EPT_BENCH_BASE, *p;
+	unsigned long val;
+	u64 t0 = 0;
+
+	/* the first n loads touch every page once, then the timed ones */
+	for (i = 0; i < n + EPT_BENCH_LOADS; i++) {
+		if (i == n)
+			t0 = rdtsc();
+		p = base + ((i * EPT_BENCH_STRIDE) & (n - 1)) * PAGE_SIZE +
+		    (i & 63) * 64;
+		if (flush)
+			invlpg(p);
+		asm volatile("mov (%1), %0; lfence" : "=r"(val) : "r"(p));
+	}
+	return (rdtsc() - t0) / EPT_BENCH_LOADS;
+}
+
+static void ept_bench_main()
+{
+	int s, i;
+
+	printf("EPT walk cost, cycles per load for a working set of\n");
+	printf("   ");
+	for (i = 0; i < ARRAY_SIZE(ept_bench_ws); i++)
+		printf(" %7luM", ept_bench_ws[i] >> 20);
+	printf("  invlpg\n");
+
+	for (s = 0; s < nr_ept_bench; s++) {
+		/* L1 switches to the next set of EPT tables */
+		if (s)
+			vmcall();
+		printf("%s:", ept_bench_names[ept_bench_sizes[s]]);
+		for (i = 0; i < ARRAY_SIZE(ept_bench_ws); i++)
+			if (ept_bench_ws[i] <= ept_bench_max_ws)
+				printf(" %8lu", ept_bench_loads(ept_bench_ws[i],
+								false));
+			else
+				printf("        -");
+		printf(" %7lu\n", ept_bench_loads(ept_bench_max_ws, true));
+	}
+}
+
+static int ept_bench_exit_handler()
+{
+	u64 guest_rip;
+	ulong reason;
+	u32 insn_len;
+	u32 stage;
+
+	guest_rip = vmcs_read(GUEST_RIP);
+	reason = vmcs_read(EXI_REASON) & 0xff;
+	insn_len = vmcs_read(EXI_INST_LEN);
+
+	switch (reason) {
+	case VMX_VMCALL:
+		stage = vmx_get_test_stage() + 1;
+		if (stage >= nr_ept_bench)
+			break;
+		vmx_set_test_stage(stage);
+		vmcs_write(EPTP, ept_bench_eptp[stage]);
+		ept_sync(INVEPT_SINGLE, ept_bench_eptp[stage]);
+		vmcs_write(GUEST_RIP, guest_rip + insn_len);
+		return VMX_TEST_RESUME;
+	default:
+		printf("Unknown exit reason, %d\n", reason);
+		print_vmexit_info();
+	}
+	return VMX_TEST_VMEXIT;
+}
+
+/*
+ * Nested exit throughput as CPUs are added: the L2 guest of every CPU
+ * does vmcalls that its L1 resumes at once, on 1, 2, 4... CPUs at the
+ * same time.  Aggregate throughput is over the union of the CPUs' runs.
+ */
+#define SMP_BENCH_EXITS		(1 << 16)
+#define SMP_BENCH_MAX_CPUS	64
+
+static u64 smp_bench_start[SMP_BENCH_MAX_CPUS];
+static u64 smp_bench_end[SMP_BENCH_MAX_CPUS];
+
+static void smp_bench_main()
+{
+	int cpu = this_vmx_cpu()->index, i;
+
+	smp_bench_start[cpu] = rdtsc();
+	for (i = 0; i < SMP_BENCH_EXITS; i++)
+		vmcall();
+	smp_bench_end[cpu] = rdtsc();
+}
+
+static int smp_bench_exit_handler()
+{
+	u64 guest_rip = vmcs_read(GUEST_RIP);
+	u32 insn_len = vmcs_read(EXI_INST_LEN);
+
+	if ((vmcs_read(EXI_REASON) & 0xff) == VMX_VMCALL) {
+		vmcs_write(GUEST_RIP, guest_rip + insn_len);
+		return VMX_TEST_RESUME;
+	}
+	print_vmexit_info();
+	return VMX_TEST_VMEXIT;
+}
+
+static struct vmx_test smp_bench_test = {
+	"nested exit scaling", NULL, smp_bench_main,
+	smp_bench_exit_handler, NULL, {0}
+};
+
+static void smp_bench_step(int ncpus)
+{
+	u64 cycles, min = ~0ull, max = 0, sum = 0;
+	u64 first, last;
+	int i;
+
+	if (test_run_smp(&smp_bench_test, ncpus))
+		return;
+	first = smp_bench_start[0];
+	last = smp_bench_end[0];
+	for (i = 0; i < ncpus; i++) {
+		cycles = (smp_bench_end[i] - smp_bench_start[i]) /
+			 SMP_BENCH_EXITS;
+		min = cycles < min ? cycles : min;
+		max = cycles > max ? cycles : max;
+		sum += cycles;
+		first = smp_bench_start[i] < first ? smp_bench_start[i] : first;
+		last = smp_bench_end[i] > last ? smp_bench_end[i] : last;
+	}
+	printf("%4d %8lu %8lu %8lu %14lu\n", ncpus, min, sum / ncpus, max,
+	       (u64)ncpus * SMP_BENCH_EXITS * 1000000 / (last - first));
+}
+
+void vmx_bench_smp(void)
+{
+	int ncpus = cpu_count(), n;
+
+	if (ncpus > SMP_BENCH_MAX_CPUS)
+		ncpus = SMP_BENCH_MAX_CPUS;
+	printf("\nTest suite: %s\n", smp_bench_test.name);
+	printf("cpus   cycles per exit on a CPU   exits per Mcycle\n");
+	printf("          min      avg      max    all CPUs\n");
+	for (n = 1; n < ncpus; n *= 2)
+		smp_bench_step(n);
+	smp_bench_step(ncpus);
+}
+
 /* name/init/guest_main/exit_handler/syscall_handler/guest_regs */
 struct vmx_test vmx_tests[] = {
 	{ "null", NULL, basic_guest_main, basic_exit_handler, NULL, {0} },
@@ -1619,3 +1862,10 @@ struct vmx_test vmx_tests[] = {
 	{ "vmmcall", vmmcall_init, vmmcall_main, vmmcall_exit_handler, NULL, {0} },
 	{ NULL, NULL, NULL, NULL, NULL, {0} },
 };
+
+/* Run instead of vmx_tests with -append bench */
+struct vmx_test vmx_bench_tests[] = {
+	{ "EPT walk cost", ept_bench_init, ept_bench_main,
+		ept_bench_exit_handler, NULL, {0} },
+	{ NULL, NULL, NULL, NULL, NULL, {0} },
+};
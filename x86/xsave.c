@@ -1,6 +1,7 @@
 #include "libcflat.h"
 #include "desc.h"
 #include "processor.h"
+#include "stats.h"
 
 #ifdef __x86_64__
 #define uint64_t unsigned long
@@ -164,9 +165,210 @@ void test_no_xsave(void)
 	xsetbv_checking(XCR_XFEATURE_ENABLED_MASK, 0x3) == UD_VECTOR);
 }
 
-int main(void)
+/*
+ * Benchmark mode (-append bench): median cycles of each save and
+ * restore instruction, for every XCR0 from x87 alone up to AVX-512,
+ * with the enabled components dirty and in their init state, plus the
+ * XSETBV exit and a plain XGETBV for comparison.
+ */
+#define X86_CR4_OSFXSR                  0x00000200
+
+#define XSTATE_OPMASK   0x20
+#define XSTATE_ZMM_Hi256 0x40
+#define XSTATE_Hi16_ZMM 0x80
+#define XSTATE_AVX512   (XSTATE_OPMASK | XSTATE_ZMM_Hi256 | XSTATE_Hi16_ZMM)
+
+#define CPUID_D_1_EAX_XSAVEOPT  (1 << 0)
+#define CPUID_D_1_EAX_XSAVEC    (1 << 1)
+#define CPUID_D_1_EAX_XSAVES    (1 << 3)
+
+#define XSAVE_HDR_OFFSET        512
+#define XSAVE_MXCSR_OFFSET      24
+#define XCOMP_BV_COMPACTED      (1ULL << 63)
+
+#define BENCH_SAMPLES 1024
+
+#define XSAVE_INSN(name, insn)                                          \
+static void name(void *area, u64 mask)                                  \
+{                                                                       \
+    asm volatile(insn : : "D" (area), "a" ((u32)mask),                  \
+                 "d" ((u32)(mask >> 32)) : "memory");                   \
+}
+
+XSAVE_INSN(xsave, ".byte 0x0f,0xae,0x27")      /* xsave (%rdi) */
+XSAVE_INSN(xsaveopt, ".byte 0x0f,0xae,0x37")   /* xsaveopt (%rdi) */
+XSAVE_INSN(xsavec, ".byte 0x0f,0xc7,0x27")     /* xsavec (%rdi) */
+XSAVE_INSN(xsaves, ".byte 0x0f,0xc7,0x2f")     /* xsaves (%rdi) */
+XSAVE_INSN(xrstor, ".byte 0x0f,0xae,0x2f")     /* xrstor (%rdi) */
+XSAVE_INSN(xrstors, ".byte 0x0f,0xc7,0x1f")    /* xrstors (%rdi) */
+
+struct xsave_bench_op {
+    const char *name;
+    void (*func)(void *area, u64 mask);
+    u32 cpuid_d_1_eax;
+    bool restore;
+    bool compacted;
+};
+
+static struct xsave_bench_op xsave_bench_ops[] = {
+    { "xsave", xsave, 0, false, false },
+    { "xsaveopt", xsaveopt, CPUID_D_1_EAX_XSAVEOPT, false, false },
+    { "xsavec", xsavec, CPUID_D_1_EAX_XSAVEC, false, true },
+    { "xsaves", xsaves, CPUID_D_1_EAX_XSAVES, false, true },
+    { "xrstor", xrstor, 0, true, false },
+    { "xrstors", xrstors, CPUID_D_1_EAX_XSAVES, true, true },
+};
+
+static u8 xsave_area[8192] __attribute__((aligned(64)));
+static u8 xsave_dirty_std[8192] __attribute__((aligned(64)));
+static u8 xsave_dirty_cmp[8192] __attribute__((aligned(64)));
+static u8 xsave_init_std[8192] __attribute__((aligned(64)));
+static u8 xsave_init_cmp[8192] __attribute__((aligned(64)));
+static u64 xsave_samples[BENCH_SAMPLES];
+
+/* Load a non-init value into one register of every enabled component. */
+static void xsave_dirty_state(u64 mask)
+{
+    asm volatile("fninit; fld1");
+    if (mask & XSTATE_SSE)
+        asm volatile("pcmpeqd %xmm0, %xmm0");
+    if (mask & XSTATE_YMM)
+        asm volatile("vpcmpeqd %ymm1, %ymm1, %ymm1");
+    if (mask & XSTATE_AVX512)
+        asm volatile("kxnorw %k1, %k1, %k1\n\t"
+                     "vpternlogd $0xff, %zmm2, %zmm2, %zmm2\n\t"
+                     "vpternlogd $0xff, %zmm16, %zmm16, %zmm16");
+}
+
+static void xsave_init_state(u64 mask)
+{
+    xrstor(xsave_init_std, mask);
+}
+
+static void xsave_init_areas(u64 mask)
+{
+    memset(xsave_init_std, 0, sizeof(xsave_init_std));
+    memset(xsave_init_cmp, 0, sizeof(xsave_init_cmp));
+    *(u32 *)(xsave_init_std + XSAVE_MXCSR_OFFSET) = 0x1f80;
+    *(u32 *)(xsave_init_cmp + XSAVE_MXCSR_OFFSET) = 0x1f80;
+    *(u64 *)(xsave_init_cmp + XSAVE_HDR_OFFSET + 8) =
+        XCOMP_BV_COMPACTED | mask;
+}
+
+static u64 xsave_bench_one(struct xsave_bench_op *op, u64 mask, bool dirty)
+{
+    void *area = xsave_area;
+    u64 t0;
+    int i;
+
+    if (op->restore) {
+        if (dirty)
+            area = op->compacted ? xsave_dirty_cmp : xsave_dirty_std;
+        else
+            area = op->compacted ? xsave_init_cmp : xsave_init_std;
+    }
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        if (!op->restore) {
+            if (dirty)
+                xsave_dirty_state(mask);
+            else
+                xsave_init_state(mask);
+        }
+        t0 = rdtsc();
+        op->func(area, mask);
+        xsave_samples[i] = rdtsc() - t0;
+    }
+
+    stats_sort(xsave_samples, BENCH_SAMPLES);
+    return stats_percentile(xsave_samples, BENCH_SAMPLES, 50);
+}
+
+static void xsave_bench_mask(u64 mask, u32 features)
+{
+    struct xsave_bench_op *op;
+    u64 t0, xcr0;
+    int i, dirty;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        t0 = rdtsc();
+        xsetbv_checking(XCR_XFEATURE_ENABLED_MASK, mask);
+        xsave_samples[i] = rdtsc() - t0;
+    }
+    stats_sort(xsave_samples, BENCH_SAMPLES);
+    printf("mask 0x%llx size %u: xsetbv %llu", mask,
+           cpuid_indexed(0xd, 0).b,
+           stats_percentile(xsave_samples, BENCH_SAMPLES, 50));
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        t0 = rdtsc();
+        xgetbv_checking(XCR_XFEATURE_ENABLED_MASK, &xcr0);
+        xsave_samples[i] = rdtsc() - t0;
+    }
+    stats_sort(xsave_samples, BENCH_SAMPLES);
+    printf(" xgetbv %llu\n",
+           stats_percentile(xsave_samples, BENCH_SAMPLES, 50));
+
+    xsave_init_areas(mask);
+    xsave_dirty_state(mask);
+    xsave(xsave_dirty_std, mask);
+    if (features & CPUID_D_1_EAX_XSAVES)
+        xsaves(xsave_dirty_cmp, mask);
+    else if (features & CPUID_D_1_EAX_XSAVEC)
+        xsavec(xsave_dirty_cmp, mask);
+
+    for (dirty = 1; dirty >= 0; dirty--) {
+        printf("mask 0x%llx %s:", mask, dirty ? "dirty" : "init");
+        for (i = 0; i < ARRAY_SIZE(xsave_bench_ops); i++) {
+            op = &xsave_bench_ops[i];
+            if ((features & op->cpuid_d_1_eax) != op->cpuid_d_1_eax)
+                continue;
+            printf(" %s %llu", op->name, xsave_bench_one(op, mask, dirty));
+        }
+        printf("\n");
+    }
+}
+
+static void xsave_bench(void)
+{
+    static const u64 masks[] = {
+        XSTATE_FP,
+        XSTATE_FP | XSTATE_SSE,
+        XSTATE_FP | XSTATE_SSE | XSTATE_YMM,
+        XSTATE_FP | XSTATE_SSE | XSTATE_YMM | XSTATE_AVX512,
+    };
+    u64 supported_xcr0;
+    u32 features;
+    int i;
+
+    if (!check_cpuid_1_ecx(CPUID_1_ECX_XSAVE)) {
+        printf("CPU don't has XSAVE feature\n");
+        return;
+    }
+
+    supported_xcr0 = get_supported_xcr0();
+    features = cpuid_indexed(0xd, 1).a;
+    printf("xsaveopt %d xsavec %d xsaves %d\n",
+           !!(features & CPUID_D_1_EAX_XSAVEOPT),
+           !!(features & CPUID_D_1_EAX_XSAVEC),
+           !!(features & CPUID_D_1_EAX_XSAVES));
+
+    write_cr4(read_cr4() | X86_CR4_OSFXSR | X86_CR4_OSXSAVE);
+    for (i = 0; i < ARRAY_SIZE(masks); i++) {
+        if ((supported_xcr0 & masks[i]) != masks[i])
+            break;
+        xsave_bench_mask(masks[i], features);
+    }
+    xsetbv_checking(XCR_XFEATURE_ENABLED_MASK, XSTATE_FP | XSTATE_SSE);
+}
+
+int main(int ac, char **av)
 {
     setup_idt();
+    if (ac > 1 && strcmp(av[1], "bench") == 0) {
+        xsave_bench();
+        return 0;
+    }
     if (check_cpuid_1_ecx(CPUID_1_ECX_XSAVE)) {
         printf("CPU has XSAVE feature\n");
         test_xsave();